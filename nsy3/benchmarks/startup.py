@@ -0,0 +1,46 @@
+"""
+Measures the executor's cold start: the time to run a runspec of small modules that each do almost nothing.
+
+Usage:
+    python3 -m nsy3.benchmarks.startup [<modules>] [<runs>]
+"""
+
+import pathlib
+import resource
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+from .. import execution
+
+
+def main(modules=20, runs=50):
+    with tempfile.TemporaryDirectory() as tmp:
+        tmp = pathlib.Path(tmp)
+        runspec = execution.Runspec([tmp])
+        for i in range(modules):
+            (tmp / f"m{i}.nsy3").write_text(f"x = {i}\n$m{i}$ = x + 1\n")
+            runspec.add_fname(tmp / f"m{i}.nsy3")
+        data = runspec.to_bytes()
+
+        empty = execution.Runspec([tmp]).to_bytes()
+        results = {}
+        for name, spec in (("empty", empty), (f"{modules} modules", data)):
+            times = []
+            cpu_before = resource.getrusage(resource.RUSAGE_CHILDREN)
+            for _ in range(runs):
+                start = time.perf_counter()
+                subprocess.run([execution.EXECUTOR, "runspec", "-"], input=spec, stdout=subprocess.DEVNULL, check=True)
+                times.append(time.perf_counter() - start)
+            cpu_after = resource.getrusage(resource.RUSAGE_CHILDREN)
+            # CPU time is steadier than wall time, which includes process creation
+            cpu = (cpu_after.ru_utime + cpu_after.ru_stime - cpu_before.ru_utime - cpu_before.ru_stime) / runs * 1000
+            results[name] = statistics.median(times) * 1000
+            print(f"{name}: median {results[name]:.2f} ms, mean CPU {cpu:.2f} ms over {runs} runs")
+        return results
+
+
+if __name__ == "__main__":
+    main(*(int(arg) for arg in sys.argv[1:]))
@@ -130,6 +130,11 @@ class Bytecode(metaclass=BCodeMeta):
     UNPACK = BCodeType("arg")
     # Add a variable that should be set to a thunk when a skip occurs, list is cleared by SETSKIP
     SKIPVAR = BCodeType("name")
+    # len is the number of pairs, items alternate key and value
+    BUILDDICT = BCodeType("len", subs=("*items"))
+    # Steps the iterator on top of the stack natively and jumps to pos with the next value pushed, or falls through to
+    # the __next__ sequence when it can't
+    FOR_ITER = BCodeType("pos")
 
     # Fake ops
 
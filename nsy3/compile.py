@@ -105,12 +105,12 @@ class CompiledCode:
             "fname": str(self.fname.resolve()) if self.fname else "",
             "imports": self.imports,
             "name": self.modname
-        })
+        }, serialisation.VERSION)
         body = serialisation.serialise({
             "consts": [(c.pos if isinstance(c, bytecode.BCode) else c) for c in self.consts],
             "linenotab": linenotab,
             "code": b"".join(full_code.to_bytes())
-        })
+        }, serialisation.VERSION)
         return header + body
 
     def to_str(self):
@@ -153,6 +153,12 @@ def compile_expr_iter(a, ctx):
             yield Bytecode.DROP(1)
             yield compile_expr(a.right, ctx)
             yield end_label
+        elif a.op == "in":
+            # Only the container knows membership, so call its rin, with the operands still evaluated left first
+            yield compile_expr(a.left, ctx)
+            yield Bytecode.GETATTR(compile_expr(a.right, ctx), ctx.const("rin"))
+            yield Bytecode.ROT(1)
+            yield Bytecode.CALL(Bytecode.IGNORE(), Bytecode.IGNORE())
         elif a.op in REFLECTED_BINOPS:
             yield Bytecode.BINOP(ctx.const(a.op, wrap=False), compile_expr(a.left, ctx), compile_expr(a.right, ctx))
         else:
@@ -185,13 +191,13 @@ def compile_expr_iter(a, ctx):
             else:
                 # List
                 yield compile_expr(a.seq, ctx)
+        elif a.type == "{}" and (not a.seq or isinstance(a.seq[0], tuple)):
+            # Dict
+            yield Bytecode.BUILDDICT(len(a.seq), *[compile_expr(x, ctx) for pair in a.seq for x in pair])
         else:
             lst = Bytecode.BUILDLIST(len(a.seq), *[compile_expr(s, ctx) for s in a.seq])
 
-            if a.type == "{}" and (not a.seq or isinstance(a.seq[0], tuple)):
-                # Dict
-                yield Bytecode.CALL(Bytecode.GET(ctx.const("Dict", wrap=False)), lst)
-            elif a.type == "{}":
+            if a.type == "{}":
                 # Set
                 yield Bytecode.CALL(Bytecode.GET(ctx.const("Set", wrap=False)), lst)
             else:
@@ -227,13 +233,15 @@ def compile_expr_iter(a, ctx):
     elif isinstance(a, ast.CompExpr):
         num_loops = len(ctx.loop_stack)
         code = [
-            Bytecode.LINENO(a.expr.lineno),
+            Bytecode.LINENO((a.expr[0] if isinstance(a.expr, tuple) else a.expr).lineno),
             ctx.const([]),
             *[compile_expr(t, ctx) for t in a.trailers]
         ]
+        # Dict comprehensions collect [key, value] pairs
+        expr = Bytecode.BUILDLIST(2, *[compile_expr(x, ctx) for x in a.expr]) if isinstance(a.expr, tuple) else compile_expr(a.expr, ctx)
         code.extend([
             Bytecode.RROT(len(ctx.loop_stack) - num_loops),
-            Bytecode.CALL(Bytecode.GETATTR(Bytecode.IGNORE(), ctx.const(":+")), compile_expr(a.expr, ctx)),
+            Bytecode.CALL(Bytecode.GETATTR(Bytecode.IGNORE(), ctx.const(":+")), expr),
             Bytecode.ROT(len(ctx.loop_stack) - num_loops),
         ])
         while len(ctx.loop_stack) > num_loops:
@@ -248,11 +256,14 @@ def compile_expr_iter(a, ctx):
     elif isinstance(a, ast.CompForExpr):
         start_label, end_label = ctx.label(), ctx.label()
         ctx.push_loop(start_label, end_label)
+        body_label = ctx.label()
         yield Bytecode.CALL(Bytecode.GETATTR(compile_expr(a.expr, ctx), ctx.const("__iter__")))
         yield start_label
+        yield Bytecode.FOR_ITER(body_label)
         yield Bytecode.CALL(Bytecode.GETATTR(Bytecode.IGNORE(), ctx.const("__next__")))
         yield Bytecode.JUMP_IFNOT_KEEP(end_label)
         yield Bytecode.UNPACK(Combine(2, HALF_INT_MAX))
+        yield body_label
         yield Bytecode.SET(ctx.const(a.name, wrap=False), Bytecode.IGNORE())
     elif isinstance(a, ast.CompIfExpr):
         yield compile_expr(a.cond, ctx)
@@ -347,16 +358,18 @@ def compile_stmt(a, ctx):
                 yield Bytecode.SET(ctx.const(varname, wrap=False), Bytecode.GETATTR(Bytecode.IGNORE(), ctx.const(modname)))
     elif isinstance(a, ast.ForStmt):
         start_label, end_label = ctx.label(), ctx.label()
-        full_end_label = ctx.label()
+        full_end_label, body_label = ctx.label(), ctx.label()
         ctx.push_loop(start_label, end_label)
         block_comp = Bytecode.SEQ(*list(compile_stmt(a.block, ctx)))
         # If there is a return statement in the block, the skip must be a return skip to avoid another return statement executing
         return_inside_block = any(op.type == Bytecode.RETURN for op in block_comp.linearize())
         yield Bytecode.CALL(Bytecode.GETATTR(compile_expr(a.expr, ctx), ctx.const("__iter__")))
         yield start_label
+        yield Bytecode.FOR_ITER(body_label)
         yield Bytecode.CALL(Bytecode.GETATTR(Bytecode.IGNORE(), ctx.const("__next__")))
         yield Bytecode.JUMP_IFNOT_KEEP(end_label)
         yield Bytecode.UNPACK(Combine(2, HALF_INT_MAX))
+        yield body_label
         yield Bytecode.SET(ctx.const(a.name, wrap=False), Bytecode.IGNORE())
         yield block_comp
         yield Bytecode.JUMP(start_label)
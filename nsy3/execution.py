@@ -1,6 +1,10 @@
 import subprocess
 import pathlib
 import re
+import os
+import select
+import struct
+import time
 
 from . import compile, parser, serialisation
 
@@ -15,6 +19,8 @@ class Runspec:
         self.compiled_files = []
         self.modules = []
         self.conclusion = None
+        self.variants = []
+        self.outputs = None
 
     def add_fname(self, fname):
         if fname not in self.files:
@@ -72,21 +78,82 @@ class Runspec:
         self.conclusion = c.to_bytes()
 
 
+    def set_outputs(self, outputs):
+        # Either a list of dotted dollar names, "conclusion" to use whatever the conclusion reads, or None for everything
+        self.outputs = outputs if isinstance(outputs, str) or outputs is None else list(outputs)
+        return self
+
+    def add_variant(self, id, values):
+        # values maps dotted dollar names to the values injected for this variant
+        self.variants.append([str(id), dict(values)])
+        return self
+
     def to_bytes(self):
         runspec = {
             "files": [str(f) for f in self.compiled_files],
             "modules": self.modules,
             "conclusion": self.conclusion
         }
-        return serialisation.serialise(runspec)
+        if self.variants:
+            runspec["variants"] = self.variants
+        if self.outputs is not None:
+            runspec["outputs"] = self.outputs
+        return serialisation.serialise(runspec, serialisation.VERSION)
+
+    def write_bundle(self, fname):
+        # Packs the compiled files and the runspec into one file, laid out as described in executor/src/bundle.hpp
+        pool, pool_index, modules = [], {}, []
+        for comp_fname in self.compiled_files:
+            data = pathlib.Path(comp_fname).read_bytes()
+            _, pos = serialisation.deserialise(data)
+            body, _ = serialisation.deserialise(data, pos)
+            indices = []
+            for const in body["consts"]:
+                # Serialised form as key, so that 1, 1.0 and True stay distinct
+                ser = serialisation.serialise(const, serialisation.VERSION)
+                if ser not in pool_index:
+                    pool_index[ser] = len(pool)
+                    pool.append(ser)
+                indices.append(pool_index[ser])
+            body["consts"] = indices
+            modules.append((str(comp_fname).encode(), data[:pos], serialisation.serialise(body, serialisation.VERSION)))
+        runspec = self.to_bytes()
+
+        offset = 28 + 24 * len(modules) + 8 * len(pool)
+        toc, pool_table, blobs = [], [], []
+        def add(blob):
+            nonlocal offset
+            blobs.append(blob)
+            offset += len(blob)
+            return [offset - len(blob), len(blob)]
+        for name, header, body in modules:
+            toc += add(name) + add(header) + add(body)
+        for ser in pool:
+            pool_table += add(ser)
+        runspec_pos = add(runspec)
+
+        with open(fname, "wb") as f:
+            f.write(b"NSY3BNDL" + struct.pack("<5I", 1, len(modules), len(pool), *runspec_pos))
+            f.write(struct.pack(f"<{len(toc) + len(pool_table)}I", *toc, *pool_table))
+            f.writelines(blobs)
+        return len(pool)
 
     def __str__(self):
         return f"Runspec({self.search_paths}, compiled_files={self.compiled_files}, modules={self.modules})"
 
-    def execute(self, return_stdout=False, return_dvs=False):
-        proc = subprocess.Popen([EXECUTOR, "runspec", "-"], stdin=subprocess.PIPE, stdout=subprocess.PIPE if return_stdout or return_dvs else None)#, stderr=subprocess.PIPE)
+    def execute(self, return_stdout=False, return_dvs=False, jobs=1, store=None, bundle=None):
+        if store is not None and self.variants and bundle is None:
+            # Variants would all write the one store, so matrix has no --store
+            raise ValueError("A result store can't be written for a runspec with variants")
+        if bundle is not None:
+            args = ["runbundle", str(bundle)]
+        else:
+            args = ["matrix", "-", f"--jobs={jobs}"] if self.variants else ["runspec", "-"]
+        if store is not None:
+            args.append(f"--store={store}")
+        proc = subprocess.Popen([EXECUTOR, *args], stdin=subprocess.PIPE, stdout=subprocess.PIPE if return_stdout or return_dvs else None)#, stderr=subprocess.PIPE)
         try:
-            stdout, stderr = proc.communicate(self.to_bytes(), timeout=10)
+            stdout, stderr = proc.communicate(None if bundle is not None else self.to_bytes(), timeout=10)
         except:
             proc.kill()
             stdout, stderr = proc.communicate()
@@ -95,11 +162,75 @@ class Runspec:
             raise RuntimeError("Execution failed")
         if return_stdout:
             return stdout
+        if return_dvs and self.variants:
+            return {m.group(1).decode(): self.extract_dvs(m.group(2))
+                    for m in re.finditer(b"=== VARIANT (.*?) ===\n(.*?)=== END VARIANT \\1 ===\n", stdout, re.DOTALL)}
         if return_dvs:
-            m = re.search(b"=== MARKER ===\n(.*)=== END MARKER ===", stdout, re.DOTALL)
-            bytes = m.group(1)
-            obj, pos = serialisation.deserialise(bytes)
-            assert pos == len(bytes)
-            print(stdout[:m.start(0)].decode())
-            print(stdout[m.end(0):].decode())
-            return obj
+            return self.extract_dvs(stdout)
+
+    def stream(self):
+        # Yields the stream records (see serialisation.iter_records) while the executor is still running
+        read_fd, write_fd = os.pipe()
+        proc = subprocess.Popen([EXECUTOR, "runspec", "-", f"--stream=/dev/fd/{write_fd}"], stdin=subprocess.PIPE, pass_fds=(write_fd,))
+        os.close(write_fd)
+        proc.stdin.write(self.to_bytes())
+        proc.stdin.close()
+        try:
+            with os.fdopen(read_fd, "rb") as f:
+                yield from serialisation.iter_records(f)
+        finally:
+            if proc.wait():
+                raise RuntimeError("Execution failed")
+
+    def watch(self, interval=100):
+        proc = subprocess.Popen([EXECUTOR, "watch", "-", f"--interval={interval}"], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        proc.stdin.write(self.to_bytes())
+        proc.stdin.close()
+        return Watcher(proc)
+
+    @staticmethod
+    def extract_dvs(stdout):
+        m = re.search(b"=== MARKER ===\n(.*)=== END MARKER ===", stdout, re.DOTALL)
+        bytes = m.group(1)
+        obj, pos = serialisation.deserialise(bytes)
+        assert pos == len(bytes)
+        print(stdout[:m.start(0)].decode())
+        print(stdout[m.end(0):].decode())
+        return obj
+
+
+class Watcher:
+    """A running `executor watch`. Recompile files in place to trigger a rerun, then read its diff."""
+    def __init__(self, proc):
+        self.proc = proc
+        self.buffer = b""
+
+    def read_block(self, name, timeout=10):
+        end = f"=== END {name} ===\n".encode()
+        deadline = time.monotonic() + timeout
+        while end not in self.buffer:
+            if b"=== ERROR ===\n" in self.buffer:
+                self.buffer = self.buffer.split(b"=== ERROR ===\n", 1)[1]
+                raise RuntimeError("Execution failed")
+            ready, _, _ = select.select([self.proc.stdout], [], [], max(0, deadline - time.monotonic()))
+            if not ready:
+                raise TimeoutError(f"No {name} from executor")
+            chunk = os.read(self.proc.stdout.fileno(), 4096)
+            if not chunk:
+                raise RuntimeError("Executor exited")
+            self.buffer += chunk
+        m = re.search(f"=== {name} ===\n".encode() + b"(.*?)" + re.escape(end), self.buffer, re.DOTALL)
+        self.buffer = self.buffer[m.end():]
+        obj, pos = serialisation.deserialise(m.group(1))
+        assert pos == len(m.group(1))
+        return obj
+
+    def results(self):
+        return self.read_block("MARKER")
+
+    def diff(self):
+        return self.read_block("DIFF")
+
+    def close(self):
+        self.proc.kill()
+        self.proc.wait()
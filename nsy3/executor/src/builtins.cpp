@@ -3,9 +3,15 @@
 #include "bytecode.hpp"
 #include "exception.hpp"
 #include "frame.hpp"
+#include "executionengine.hpp"
+#include "kernels.hpp"
+#include "thunk.hpp"
+#include "threadpool.hpp"
+#include <cmath>
 #include <iostream>
 
 ObjectRef print(const std::vector<ObjectRef>& args) {
+    serial_only();
     std::cout << " -> ";
     for (auto& arg : args) {
         std::cout << arg << " ";
@@ -27,6 +33,7 @@ bool not_(ObjectRef arg) {
 }
 
 ObjectRef assert(ObjectRef obj) {
+    serial_only();
     if (!obj->to_bool()) {
         create<AssertionError>("Assertion failed")->raise();
     }
@@ -34,6 +41,23 @@ ObjectRef assert(ObjectRef obj) {
     return NoneType::none;
 }
 
+class RangeCursor : public NativeIterator {
+    mutable int current;
+    int stop;
+public:
+    RangeCursor(TypeRef type, int start, int stop) : NativeIterator(type), current(start), stop(stop) {}
+    bool next(ObjectRef& value) const override {
+        if (current >= stop) {
+            return false;
+        }
+        value = create<Integer>(current++);
+        return true;
+    }
+    std::shared_ptr<const NativeIterator> clone() const override {
+        return std::make_shared<RangeCursor>(*this);
+    }
+};
+
 class Range : public Object {
     int start_, stop_;
 public:
@@ -42,6 +66,7 @@ public:
         return "Range(" + std::to_string(start_) +  ", " + std::to_string(stop_) + ")";
     }
     static TypeRef type;
+    int size() const { return std::max(0, stop_ - start_); }
     ObjectRef next() const {
         if (start_ >= stop_) {
             return NoneType::none;
@@ -50,6 +75,9 @@ public:
             return create<List>(std::vector<ObjectRef>{create<Range>(start_ + 1, stop_), create<Integer>(start_)});
         }
     }
+    std::shared_ptr<const NativeIterator> native_iter() const override {
+        return std::make_shared<RangeCursor>(NativeIterator::type, start_, stop_);
+    }
 };
 
 TypeRef Range::type = create<Type>("Range", Type::basevec{Object::type}, Type::attrmap{
@@ -62,6 +90,248 @@ TypeRef Range::type = create<Type>("Range", Type::basevec{Object::type}, Type::a
     })}
 });
 
+namespace {
+    // Lists are used as they are, anything else iterable is gathered into one (which stores it unboxed if it can)
+    std::shared_ptr<const List> as_list(const ObjectRef& obj) {
+        if (auto list = std::dynamic_pointer_cast<const List>(obj)) {
+            return list;
+        }
+        std::vector<ObjectRef> items;
+        auto iter = obj->gettype("__iter__")->call_no_thunks({});
+        if (auto cursor = iter->native_iter()) {
+            ObjectRef value;
+            while (cursor->next(value)) {
+                items.push_back(std::move(value));
+            }
+        }
+        else {
+            for (auto next = iter->gettype("__next__")->call_no_thunks({}); next != NoneType::none;) {
+                auto pair = convert<const List*>(next);
+                items.push_back(pair->item(1));
+                next = pair->item(0)->gettype("__next__")->call_no_thunks({});
+            }
+        }
+        return create<List>(std::move(items));
+    }
+
+    ObjectRef len(ObjectRef obj) {
+        if (auto list = dynamic_cast<const List*>(obj.get())) {
+            return create<Integer>(list->size());
+        }
+        if (auto str = dynamic_cast<const String*>(obj.get())) {
+            return create<Integer>(str->get().size());
+        }
+        if (auto bytes = dynamic_cast<const Bytes*>(obj.get())) {
+            return create<Integer>(bytes->get().size());
+        }
+        if (auto dict = dynamic_cast<const Dict*>(obj.get())) {
+            return create<Integer>(dict->get().size());
+        }
+        if (auto set = dynamic_cast<const Set*>(obj.get())) {
+            return create<Integer>(set->get().size());
+        }
+        if (auto range = dynamic_cast<const Range*>(obj.get())) {
+            return create<Integer>(range->size());
+        }
+        create<TypeError>("Object of type '" + obj->obj_type()->name() + "' has no length")->raise();
+        return nullptr;
+    }
+
+    // Typed storage is sorted unboxed, anything else with <. NaNs go last, since < alone isn't an ordering with them.
+    ObjectRef sorted(ObjectRef obj) {
+        auto list = as_list(obj);
+        return std::visit([](auto& values) {
+            auto items = values.to_vector();
+            if constexpr (std::is_same_v<std::decay_t<decltype(values)>, PVector<ObjectRef>>) {
+                std::stable_sort(items.begin(), items.end(), [](const ObjectRef& a, const ObjectRef& b) {
+                    return convert<bool>(a->gettype("<")->call_no_thunks({b}));
+                });
+                return create<List>(std::move(items));
+            }
+            else if constexpr (std::is_same_v<typename decltype(items)::value_type, double>) {
+                std::sort(items.begin(), items.end(), [](double a, double b) {
+                    return a < b || (std::isnan(b) && !std::isnan(a));
+                });
+                return create<List>(List::Storage(std::move(items)));
+            }
+            else {
+                std::sort(items.begin(), items.end());
+                return create<List>(List::Storage(std::move(items)));
+            }
+        }, list->storage());
+    }
+
+    template<bool All> ObjectRef any_all(ObjectRef obj) {
+        auto list = as_list(obj);
+        bool res = std::visit([](auto& values) {
+            using T = typename std::decay_t<decltype(values)>::const_iterator::value_type;
+            if constexpr (std::is_same_v<T, ObjectRef>) {
+                auto truthy = [](const ObjectRef& item) { return item->to_bool(); };
+                return All ? std::all_of(values.begin(), values.end(), truthy) : std::any_of(values.begin(), values.end(), truthy);
+            }
+            else {
+                // all: no zeros anywhere, any: not all zeros
+                bool found = false;
+                values.for_each_chunk([&](const T* data, std::size_t count) {
+                    found = found || (All ? kernels::contains(data, count, T(0)) : !kernels::all_equal(data, count, T(0)));
+                });
+                return All ? !found : found;
+            }
+        }, list->storage());
+        return res ? Boolean::true_ : Boolean::false_;
+    }
+
+    // Stops at the shortest
+    ObjectRef zip(const std::vector<ObjectRef>& args) {
+        std::vector<std::shared_ptr<const List>> lists;
+        std::size_t size = args.empty() ? 0 : SIZE_MAX;
+        for (auto& arg : args) {
+            lists.push_back(as_list(arg));
+            size = std::min(size, lists.back()->size());
+        }
+        std::vector<ObjectRef> res;
+        res.reserve(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            std::vector<ObjectRef> items;
+            for (auto& list : lists) {
+                items.push_back(list->item(i));
+            }
+            res.push_back(create<List>(std::move(items)));
+        }
+        return create<List>(std::move(res));
+    }
+
+    ObjectRef enumerate(ObjectRef obj) {
+        auto list = as_list(obj);
+        std::vector<ObjectRef> res;
+        res.reserve(list->size());
+        for (std::size_t i = 0; i < list->size(); ++i) {
+            res.push_back(create<List>(std::vector<ObjectRef>{create<Integer>(i), list->item(i)}));
+        }
+        return create<List>(std::move(res));
+    }
+
+    enum class BulkKind { MAP, FILTER };
+    using Items = std::shared_ptr<const std::vector<ObjectRef>>;
+    // Shared by every thunk along one map or filter, so carrying on doesn't copy the results so far
+    using Results = std::shared_ptr<std::vector<ObjectRef>>;
+
+    BaseObjectRef run_bulk(BulkKind kind, ObjectRef func, Items items, Results results, std::size_t position);
+
+    void record(BulkKind kind, std::vector<ObjectRef>& results, const ObjectRef& item, ObjectRef res) {
+        if (kind == BulkKind::MAP) {
+            results.push_back(std::move(res));
+        }
+        else if (res->to_bool()) {
+            results.push_back(item);
+        }
+    }
+
+    // The rest of a map or filter whose callable returned a thunk, carried on once the thunk has a value
+    class BulkThunk : public Thunk {
+        BulkKind kind;
+        ObjectRef func;
+        Items items;
+        Results results;
+        // How many results there were when this thunk was made. A thunk notified again after a reset drops the
+        // ones recorded after that.
+        std::size_t done;
+        std::size_t position;
+    public:
+        BulkThunk(ExecutionEngine* execengine, BulkKind kind, ObjectRef func, Items items, Results results, std::size_t position)
+            : Thunk(execengine), kind(kind), func(std::move(func)), items(std::move(items)), results(std::move(results)), done(this->results->size()), position(position) {}
+        void notify(BaseObjectRef obj) const override {
+            if (auto thunk = dynamic_cast<const Thunk*>(obj.get())) {
+                thunk->subscribe(std::dynamic_pointer_cast<const Thunk>(shared_from_this()));
+                return;
+            }
+            ExecutingModule executing(execution_engine(), &module());
+            results->resize(done);
+            record(kind, *results, (*items)[position], std::dynamic_pointer_cast<const Object>(obj));
+            finalize(run_bulk(kind, func, items, results, position + 1));
+        }
+        std::string to_str() const override {
+            return "BT(" + std::to_string(position) + ")";
+        }
+    };
+
+    BaseObjectRef run_bulk(BulkKind kind, ObjectRef func, Items items, Results results, std::size_t position) {
+        for (; position < items->size(); ++position) {
+            auto res = func->call({(*items)[position]});
+            if (auto thunk = std::dynamic_pointer_cast<const Thunk>(res)) {
+                auto rest = std::make_shared<BulkThunk>(thunk->execution_engine(), kind, func, items, results, position);
+                thunk->subscribe(rest);
+                return rest;
+            }
+            record(kind, *results, (*items)[position], std::dynamic_pointer_cast<const Object>(res));
+        }
+        // Thunks along the way still hold the results, and may need them after a reset
+        return create<List>(results.use_count() == 1 ? std::move(*results) : *results);
+    }
+
+    template<BulkKind Kind> BaseObjectRef bulk(ObjectRef func, ObjectRef iterable) {
+        // Types are called through __new__, looked up once rather than per item
+        if (auto type = dynamic_cast<const Type*>(func.get())) {
+            if (auto constructor = std::dynamic_pointer_cast<const Object>(type->getattr("__new__"))) {
+                func = constructor;
+            }
+        }
+        auto list = as_list(iterable);
+        auto results = std::make_shared<std::vector<ObjectRef>>();
+        results->reserve(Kind == BulkKind::MAP ? list->size() : 0);
+        return run_bulk(Kind, std::move(func), std::make_shared<const std::vector<ObjectRef>>(list->get().to_vector()), std::move(results), 0);
+    }
+
+    // Calls with chunks of items on the shared pool when func is a pure Function. A chunk that reaches the engine anyway
+    // abandons the attempt, and the whole call is redone serially, since only serial evaluation can wait on thunks.
+    BaseObjectRef pmap(ObjectRef func, ObjectRef iterable) {
+        auto list = as_list(iterable);
+        auto items = std::make_shared<const std::vector<ObjectRef>>(list->get().to_vector());
+        auto function = dynamic_cast<const Function*>(func.get());
+        auto threads = std::min<std::size_t>(items->size(), ThreadPool::default_threads());
+        if (function && threads > 1 && !ParallelChunk::running && function->pure()) {
+            // Several chunks per thread even out items that take longer than others
+            auto chunk_size = std::max<std::size_t>(1, items->size() / (threads * 4));
+            std::vector<ObjectRef> results(items->size());
+            std::vector<std::future<void>> chunks;
+            bool serial = false;
+            auto& pool = ThreadPool::shared();
+            for (std::size_t start = 0; start < items->size(); start += chunk_size) {
+                chunks.push_back(pool.submit([&, start]() {
+                    ParallelChunk chunk;
+                    for (auto i = start; i < std::min(start + chunk_size, items->size()); ++i) {
+                        results[i] = std::dynamic_pointer_cast<const Object>(func->call({(*items)[i]}));
+                    }
+                }));
+            }
+            // The chunks refer to locals, so every one has to finish before anything is thrown
+            for (auto& chunk : chunks) {
+                chunk.wait();
+            }
+            // Errors are raised in order of the items, as serially, unless an earlier chunk means redoing it all
+            for (auto& chunk : chunks) {
+                try {
+                    chunk.get();
+                }
+                catch (const NotParallelSafe&) {
+                    serial = true;
+                }
+                catch (...) {
+                    if (!serial) {
+                        throw;
+                    }
+                }
+            }
+            if (!serial) {
+                return create<List>(std::move(results));
+            }
+        }
+        auto results = std::make_shared<std::vector<ObjectRef>>();
+        results->reserve(items->size());
+        return run_bulk(BulkKind::MAP, std::move(func), std::move(items), std::move(results), 0);
+    }
+}
+
 std::map<std::string, ObjectRef> builtins = {
     // Types
     {"Object", Object::type},
@@ -72,6 +342,7 @@ std::map<std::string, ObjectRef> builtins = {
     {"Bytes", Bytes::type},
     {"List", List::type},
     {"Dict", Dict::type},
+    {"Set", Set::type},
     {"Range", Range::type},
 
     // Consts
@@ -86,5 +357,17 @@ std::map<std::string, ObjectRef> builtins = {
     {"[]", create<BuiltinFunction>(braks)},
     {"assert", create<BuiltinFunction>(assert)},
     {"not", create<BuiltinFunction>(not_)},
+    {"len", create<BuiltinFunction>(len)},
+    {"sum", create<BuiltinFunction>([](ObjectRef obj) { return as_list(obj)->gettype("sum")->call_no_thunks({}); })},
+    {"min", create<BuiltinFunction>([](ObjectRef obj) { return as_list(obj)->gettype("min")->call_no_thunks({}); })},
+    {"max", create<BuiltinFunction>([](ObjectRef obj) { return as_list(obj)->gettype("max")->call_no_thunks({}); })},
+    {"sorted", create<BuiltinFunction>(sorted)},
+    {"any", create<BuiltinFunction>(any_all<false>)},
+    {"all", create<BuiltinFunction>(any_all<true>)},
+    {"zip", create<BuiltinFunction>(zip)},
+    {"enumerate", create<BuiltinFunction>(enumerate)},
+    {"map", create<BuiltinFunction>(bulk<BulkKind::MAP>)},
+    {"filter", create<BuiltinFunction>(bulk<BulkKind::FILTER>)},
+    {"pmap", create<BuiltinFunction>(pmap)},
 
 };
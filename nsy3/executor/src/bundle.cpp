@@ -0,0 +1,89 @@
+#include "bundle.hpp"
+#include "serialisation.hpp"
+#include "functionutils.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    const char MAGIC[8] = {'N', 'S', 'Y', '3', 'B', 'N', 'D', 'L'};
+    const unsigned int VERSION = 1;
+    const std::size_t HEADER_SIZE = sizeof(MAGIC) + 20;
+    const std::size_t TOC_ENTRY_SIZE = 24;
+    const std::size_t POOL_ENTRY_SIZE = 8;
+
+    unsigned int read_u32(const char* data) {
+        unsigned int v;
+        std::memcpy(&v, data, 4);
+        return v;
+    }
+}
+
+Bundle::Bundle(const std::string& fname) : file(std::make_shared<const MappedFile>(fname)) {
+    if (file->size() < HEADER_SIZE || std::memcmp(file->data(), MAGIC, sizeof(MAGIC))) {
+        throw std::runtime_error(fname + " is not a bundle");
+    }
+    auto header = file->data() + sizeof(MAGIC);
+    if (read_u32(header) != VERSION) {
+        throw std::runtime_error(fname + " has an unsupported bundle version");
+    }
+    auto module_count = read_u32(header + 4), pool_count = read_u32(header + 8);
+    if (HEADER_SIZE + TOC_ENTRY_SIZE * module_count + POOL_ENTRY_SIZE * pool_count > file->size()) {
+        throw std::runtime_error(fname + " is truncated");
+    }
+
+    auto entry = file->data() + HEADER_SIZE;
+    for (auto i = 0u; i < module_count; ++i, entry += TOC_ENTRY_SIZE) {
+        toc.emplace(slice(read_u32(entry), read_u32(entry + 4)), Entry{
+            slice(read_u32(entry + 8), read_u32(entry + 12)),
+            slice(read_u32(entry + 16), read_u32(entry + 20))
+        });
+    }
+    for (auto i = 0u; i < pool_count; ++i, entry += POOL_ENTRY_SIZE) {
+        pool.push_back(slice(read_u32(entry), read_u32(entry + 4)));
+    }
+    pool_objects.resize(pool_count);
+
+    auto runspec_data = slice(read_u32(header + 12), read_u32(header + 16));
+    runspec_ = deserialise_from_memory(runspec_data, file);
+}
+
+std::string_view Bundle::slice(unsigned int offset, unsigned int len) const {
+    if (offset + static_cast<std::size_t>(len) > file->size()) {
+        throw std::runtime_error("Bundle offset out of bounds");
+    }
+    return file->view().substr(offset, len);
+}
+
+ObjectRef Bundle::constant(std::size_t index) const {
+    if (index >= pool.size()) {
+        throw std::runtime_error("Bundle constant out of range");
+    }
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!pool_objects[index]) {
+        auto data = pool[index];
+        pool_objects[index] = deserialise_from_memory(data, file);
+    }
+    return pool_objects[index];
+}
+
+std::shared_ptr<const Code> Bundle::load(const std::string& fname, ConstInterner* interner) const {
+    auto iter = toc.find(fname);
+    if (iter == toc.end()) {
+        throw std::runtime_error(fname + " is not in the bundle");
+    }
+    auto header_data = iter->second.header, body_data = iter->second.body;
+    auto header = deserialise_from_memory(header_data, file);
+    auto body = convert_ptr<Dict>(deserialise_from_memory(body_data, file))->get();
+
+    auto consts_key = create<String>("consts");
+    auto indices = body.lookup(consts_key);
+    if (!indices) {
+        throw std::runtime_error("Code is missing consts");
+    }
+    std::vector<ObjectRef> consts;
+    for (auto& index : convert_ptr<List>(*indices)->get()) {
+        consts.push_back(constant(convert<int>(index)));
+    }
+    return create<Code>(header, create<Dict>(body.set(consts_key, create<List>(std::move(consts)))), interner);
+}
@@ -0,0 +1,44 @@
+#ifndef BUNDLE_HPP
+#define BUNDLE_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "mappedfile.hpp"
+
+// Bundle file layout (all integers are little endian u32), written by Runspec.write_bundle:
+//   "NSY3BNDL", version, module count, pool count, runspec offset, runspec length
+//   module count TOC entries of {name offset, name length, header offset, header length, body offset, body length},
+//     where name is the file name the runspec refers to the module by
+//   pool count entries of {offset, length}, one for each serialised constant
+//   the data referred to by the offsets above, which are from the start of the file
+// Module headers are stored as in .nsy3c files. Module bodies are too, except that their consts are indices into the
+// constant pool, which is shared by all modules.
+
+class Bundle {
+    struct Entry {
+        std::string_view header, body;
+    };
+
+    std::shared_ptr<const MappedFile> file;
+    std::map<std::string, Entry, std::less<>> toc;
+    std::vector<std::string_view> pool;
+    // Constants are deserialised when a module using them is first loaded, which may be on several threads at once
+    mutable std::vector<ObjectRef> pool_objects;
+    mutable std::mutex pool_mutex;
+    ObjectRef runspec_;
+
+    std::string_view slice(unsigned int offset, unsigned int len) const;
+    ObjectRef constant(std::size_t index) const;
+public:
+    Bundle(const std::string& fname);
+    ObjectRef runspec() const { return runspec_; }
+    std::shared_ptr<const Code> load(const std::string& fname, ConstInterner* interner = nullptr) const;
+};
+
+#endif // BUNDLE_HPP
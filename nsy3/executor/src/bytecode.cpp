@@ -2,43 +2,104 @@
 #include "serialisation.hpp"
 #include "frame.hpp"
 #include "functionutils.hpp"
+#include "mappedfile.hpp"
+#include "sourcecache.hpp"
+#include "thunk.hpp"
 
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <mutex>
 
 TypeRef Code::type = create<Type>("Code", Type::basevec{Object::type});
 
 Code::Code(TypeRef type, std::basic_string<unsigned char> code, std::vector<ObjectRef> consts, std::string fname, std::basic_string<unsigned char> linenotab)
-    : Object(type), code(code), consts(consts), fname(fname), linenotab(linenotab) {
+    : Object(type), code_storage(create<Bytes>(code)), linenotab_storage(create<Bytes>(linenotab)), consts(consts), fname(fname) {
+    this->code = code_storage->get();
+    this->linenotab = linenotab_storage->get();
+    build_line_table();
 }
 
-std::shared_ptr<const Code> Code::from_file(std::string fname) {
-    std::ifstream f(fname);
-    if (!f) {
+std::shared_ptr<const Code> Code::from_file(std::string fname, ConstInterner* interner) {
+    std::shared_ptr<const MappedFile> file;
+    try {
+        file = std::make_shared<const MappedFile>(fname);
+    }
+    catch (const std::runtime_error&) {
         throw std::runtime_error("Could not open file");
     }
+    auto data = file->view();
+    auto header = deserialise_from_memory(data, file);
+    auto body = deserialise_from_memory(data, file);
+    return create<Code>(header, body, interner);
+}
 
-    auto header = deserialise_from_file(f);
-    auto body = deserialise_from_file(f);
-    return create<Code>(header, body);
+std::shared_ptr<const Code> Code::from_string(std::string code, ConstInterner* interner) {
+    auto owner = std::make_shared<const std::string>(std::move(code));
+    std::string_view data = *owner;
+    auto header = deserialise_from_memory(data, owner);
+    auto body = deserialise_from_memory(data, owner);
+    return create<Code>(header, body, interner);
+}
+
+namespace {
+    ObjectRef field(const ObjectRef& dict, const char* name) {
+        auto value = convert_ptr<Dict>(dict)->get().lookup(create<String>(name));
+        if (!value) {
+            throw std::runtime_error(std::string("Code is missing ") + name);
+        }
+        return *value;
+    }
+}
+
+Code::Code(TypeRef type, ObjectRef header, ObjectRef body, ConstInterner* interner) : Object(type) {
+    code_storage = convert_ptr<Bytes>(field(body, "code"));
+    linenotab_storage = convert_ptr<Bytes>(field(body, "linenotab"));
+    code = code_storage->get();
+    linenotab = linenotab_storage->get();
+    build_line_table();
+    for (auto& obj : convert_ptr<List>(field(body, "consts"))->get()) {
+        consts.push_back(interner ? interner->intern(obj) : obj);
+    }
+    fname = convert<std::string>(field(header, "fname"));
+    modulename_ = convert<std::string>(field(header, "name"));
 }
 
-std::shared_ptr<const Code> Code::from_string(std::string code) {
-    std::stringstream f(code);
-    auto header = deserialise_from_file(f);
-    auto body = deserialise_from_file(f);
-    return create<Code>(header, body);
+ObjectRef ConstInterner::intern(const ObjectRef& obj) {
+    auto type = obj->obj_type().get();
+    Key key{0, {}, 0};
+    if (type == String::type.get()) {
+        key = {'s', static_cast<const String*>(obj.get())->get(), 0};
+    }
+    else if (type == Bytes::type.get()) {
+        auto bytes = static_cast<const Bytes*>(obj.get())->get();
+        key = {'b', std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size()), 0};
+    }
+    else if (type == Integer::type.get()) {
+        key.tag = 'i';
+        auto value = static_cast<const Integer*>(obj.get())->get();
+        std::memcpy(&key.bits, &value, sizeof(value));
+    }
+    else if (type == Float::type.get()) {
+        key.tag = 'f';
+        auto value = static_cast<const Float*>(obj.get())->get();
+        std::memcpy(&key.bits, &value, sizeof(value));
+    }
+    else {
+        return obj;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // The key views obj, which is what the table keeps
+    return interned.emplace(key, obj).first->second;
 }
 
-Code::Code(TypeRef type, ObjectRef header, ObjectRef body) : Object(type) {
-    auto header_map = convert<std::map<std::string, ObjectRef>>(header);
-    auto body_map = convert<std::map<std::string, ObjectRef>>(body);
-    code = convert<std::basic_string<unsigned char>>(body_map["code"]);
-    consts = convert<std::vector<ObjectRef>>(body_map["consts"]);
-    fname = convert<std::string>(header_map["fname"]);
-    linenotab = convert<std::basic_string<unsigned char>>(body_map["linenotab"]);
-    modulename_ = convert<std::string>(header_map["name"]);
+void ConstInterner::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    interned = {};
 }
 
 void Code::print(std::ostream& stream) const {
@@ -48,18 +109,14 @@ void Code::print(std::ostream& stream) const {
         stream << "  " << i << ": " << consts[i] << "\n";
     }
     stream << "\nCode:\n";
-    unsigned int pos = 0;
-    unsigned int lineno = 0, lineno_bcode_pos = 0;
-    auto linenotab_iter = linenotab.begin();
-    bool lineno_change = false;
-    while (pos < code.size()) {
-        lineno_change = false;
-        while (pos >= lineno_bcode_pos + *linenotab_iter && linenotab_iter != linenotab.end()) {
-            lineno_bcode_pos += *linenotab_iter++;
-            lineno += static_cast<signed char>(*linenotab_iter++);
-            lineno_change = true;
-        }
-        if (lineno_change) {
+    // The first entry is the starting state rather than a line change
+    auto line = std::next(line_table.begin());
+    for (unsigned int pos = 0; pos < code.size(); pos += 5) {
+        if (line != line_table.end() && pos >= line->first) {
+            while (line != line_table.end() && pos >= line->first) {
+                ++line;
+            }
+            auto lineno = std::prev(line)->second;
             stream << "Line " << lineno << ": " << get_line_of_file(fname, lineno, true) << "\n";
         }
         auto op = code[pos];
@@ -88,20 +145,76 @@ void Code::print(std::ostream& stream) const {
             case Ops::BUILDLIST: stream << "BUILDLIST " << arg << "\n"; break;
             case Ops::UNPACK: stream << "UNPACK " << (arg & 0xFFFF) << " " << (arg >> 16) << "\n"; break;
             case Ops::SKIPVAR: stream << "SKIPVAR " << arg << "\n"; break;
+            case Ops::BUILDDICT: stream << "BUILDDICT " << arg << "\n"; break;
+            case Ops::FOR_ITER: stream << "FOR_ITER " << arg << "\n"; break;
             default: stream << "UNKNOWN " << static_cast<unsigned int>(op) << " " << arg << "\n"; break;
         }
-        pos += 5;
     }
 }
 
-unsigned int Code::lineno_for_position(unsigned int position) const {
+void Code::validate() const {
+    auto fail = [this](unsigned int pos, const std::string& message) {
+        throw std::runtime_error("Invalid code in " + fname + " at " + std::to_string(pos) + ": " + message);
+    };
+    if (code.size() % 5) {
+        fail(code.size(), "truncated instruction");
+    }
+    if (linenotab.size() % 2) {
+        fail(0, "truncated line number table");
+    }
+    for (unsigned int pos = 0; pos < code.size(); pos += 5) {
+        auto op = static_cast<Ops>(code[pos]);
+        unsigned int arg;
+        std::memcpy(&arg, code.data() + pos + 1, sizeof(arg));
+        switch (op) {
+            case Ops::BINOP:
+            case Ops::GET:
+            case Ops::SET:
+            case Ops::CONST:
+            case Ops::SKIPVAR:
+                if (arg >= consts.size()) {
+                    fail(pos, "const index out of range");
+                }
+                break;
+            case Ops::JUMP:
+            case Ops::JUMP_IF:
+            case Ops::JUMP_IFNOT:
+            case Ops::JUMP_IF_KEEP:
+            case Ops::JUMP_IFNOT_KEEP:
+            case Ops::FOR_ITER:
+                if (arg > code.size() || arg % 5) {
+                    fail(pos, "bad jump target");
+                }
+                break;
+            case Ops::SETSKIP:
+                if ((arg & 0xFFFF) != 0xFFFF && ((arg & 0xFFFF) > code.size() || (arg & 0xFFFF) % 5)) {
+                    fail(pos, "bad skip target");
+                }
+                break;
+            default:
+                if (op > Ops::FOR_ITER) {
+                    fail(pos, "unknown op " + std::to_string(code[pos]));
+                }
+        }
+    }
+}
+
+void Code::build_line_table() {
     unsigned int lineno = 0, lineno_bcode_pos = 0;
-    auto linenotab_iter = linenotab.begin();
-    while (position >= lineno_bcode_pos + *linenotab_iter && linenotab_iter != linenotab.end()) {
-        lineno_bcode_pos += *linenotab_iter++;
-        lineno += static_cast<signed char>(*linenotab_iter++);
+    line_table.clear();
+    line_table.emplace_back(0, 0);
+    for (std::size_t i = 0; i + 1 < linenotab.size(); i += 2) {
+        lineno_bcode_pos += linenotab[i];
+        lineno += static_cast<signed char>(linenotab[i + 1]);
+        line_table.emplace_back(lineno_bcode_pos, lineno);
     }
-    return lineno;
+}
+
+unsigned int Code::lineno_for_position(unsigned int position) const {
+    auto iter = std::upper_bound(line_table.begin(), line_table.end(), position, [](unsigned int pos, const auto& entry) {
+        return pos < entry.first;
+    });
+    return std::prev(iter)->second;
 }
 
 std::string Code::filename() const {
@@ -145,7 +258,7 @@ TypeRef Function::type = create<Type>("Function", Type::basevec{Object::type}, T
     {"signature", create<Property>(create<BuiltinFunction>(method(&Function::signature)))}
 });
 
-Function::Function(TypeRef type, std::shared_ptr<const Code> code, int offset, std::shared_ptr<const Signature> signature, std::map<std::string, BaseObjectRef> env)
+Function::Function(TypeRef type, std::shared_ptr<const Code> code, int offset, std::shared_ptr<const Signature> signature, EnvMap env)
     : Object(type), code(code), offset(offset), signature_(signature), env(env) {
 }
 
@@ -164,6 +277,73 @@ BaseObjectRef Function::call(const std::vector<ObjectRef>& args) const {
     return create<Frame>(code, offset, new_env)->execute()["return"];
 }
 
+bool Function::pure() const {
+    std::set<std::pair<const Code*, int>> seen;
+    return pure(seen);
+}
+
+bool Function::pure(std::set<std::pair<const Code*, int>>& seen) const {
+    static const std::set<std::string_view> impure = {"$?", "$=", "alias", "import", "subs", "test_thunk", "print", "assert"};
+    // Every instruction reachable from the start of the body, and of the bodies of functions defined in it
+    std::vector<unsigned int> todo = {static_cast<unsigned int>(offset)};
+    auto name_at = [this](unsigned int arg) { return dynamic_cast<const String*>(code->consts[arg].get()); };
+    while (!todo.empty()) {
+        auto position = todo.back();
+        todo.pop_back();
+        if (!seen.emplace(code.get(), position).second) {
+            continue;
+        }
+        for (bool next = true; next && position + 5 <= code->code.size(); position += 5) {
+            auto op = static_cast<Ops>(code->code[position]);
+            auto arg = *reinterpret_cast<const unsigned int*>(code->code.data() + position + 1);
+            switch (op) {
+                case Ops::GET: {
+                    auto name = name_at(arg);
+                    if (!name || impure.count(name->get())) {
+                        return false;
+                    }
+                    // Functions are defined by calling -> with __code__ and the offset of their body
+                    if (name->get() == "__code__" && position + 10 <= code->code.size()
+                        && static_cast<Ops>(code->code[position + 5]) == Ops::CONST) {
+                        auto body = *reinterpret_cast<const unsigned int*>(code->code.data() + position + 6);
+                        if (auto body_offset = dynamic_cast<const Integer*>(code->consts[body].get())) {
+                            todo.push_back(body_offset->get());
+                        }
+                    }
+                    auto iter = env.find(name->get());
+                    if (iter == env.end()) {
+                        break;
+                    }
+                    if (dynamic_cast<const Thunk*>(iter->second.get())) {
+                        return false;
+                    }
+                    if (auto func = dynamic_cast<const Function*>(iter->second.get()); func && !func->pure(seen)) {
+                        return false;
+                    }
+                    break;
+                }
+                case Ops::JUMP:
+                    todo.push_back(arg);
+                    next = false;
+                    break;
+                case Ops::JUMP_IF:
+                case Ops::JUMP_IFNOT:
+                case Ops::JUMP_IF_KEEP:
+                case Ops::JUMP_IFNOT_KEEP:
+                case Ops::FOR_ITER:
+                    todo.push_back(arg);
+                    break;
+                case Ops::RETURN:
+                    next = false;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    return true;
+}
+
 std::string Function::to_str() const {
     return "F(?)";
 }
@@ -174,16 +354,10 @@ std::string ltrim(const std::string &s) {
 }
 
 std::string get_line_of_file(std::string fname, int lineno, bool trim) {
-    std::string res;
-    std::ifstream f(fname);
-    int current_line = 1;
-    while (f) {
-        std::getline(f, res);
-        if (current_line == lineno) {
-            return trim ? ltrim(res) : res;
-        }
-        ++current_line;
+    auto source = source_file(fname);
+    if (!source) {
+        return "";
     }
-    res.clear();
-    return res;
+    std::string res(source->line(lineno));
+    return trim ? ltrim(res) : res;
 }
@@ -1,10 +1,17 @@
 #ifndef BYTECODE_HPP
 #define BYTECODE_HPP
 
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "object.hpp"
+#include "flathashmap.hpp"
 
 
 enum class Ops : unsigned char {
@@ -29,29 +36,71 @@ enum class Ops : unsigned char {
     RROT,
     BUILDLIST,
     UNPACK,
-    SKIPVAR
+    SKIPVAR,
+    BUILDDICT,
+    FOR_ITER
+};
+
+// Makes identical string, bytes and number constants in all the code an engine loads the same object. The first
+// constant seen is kept as it is, so an interned string may be a view into the file it was loaded from, keeping it
+// mapped until the interner is cleared (as the engine does when it reloads code). Safe to use from several threads.
+class ConstInterner {
+    // Strings and bytes by a view of their value in the interned object, numbers by their representation (so 0.0 and
+    // -0.0 stay distinct)
+    struct Key {
+        char tag;
+        std::string_view bytes;
+        uint64_t bits;
+    };
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const {
+            return std::hash<std::string_view>{}(key.bytes) ^ std::hash<uint64_t>{}(key.bits) ^ key.tag;
+        }
+    };
+    struct KeyEq {
+        bool operator()(const Key& a, const Key& b) const {
+            return a.tag == b.tag && a.bits == b.bits && a.bytes == b.bytes;
+        }
+    };
+
+    std::mutex mutex;
+    FlatHashMap<Key, ObjectRef, KeyHash, KeyEq> interned;
+public:
+    // Returns the shared instance equal to obj, or obj itself for other types
+    ObjectRef intern(const ObjectRef& obj);
+    void clear();
 };
 
 class Code : public Object {
-    std::basic_string<unsigned char> code;
+    // Views into Bytes objects, which may in turn be views into the mapped code file
+    std::basic_string_view<unsigned char> code, linenotab;
+    std::shared_ptr<const Bytes> code_storage, linenotab_storage;
     std::vector<ObjectRef> consts;
     std::string fname, modulename_;
-    std::basic_string<unsigned char> linenotab;
+    // (position, line number) at each line change, in order of position, decoded from linenotab
+    std::vector<std::pair<unsigned int, unsigned int>> line_table;
+
+    void build_line_table();
 
 public:
     Code(TypeRef type, std::basic_string<unsigned char> code, std::vector<ObjectRef> consts, std::string fname, std::basic_string<unsigned char> linenotab);
-    Code(TypeRef type, ObjectRef header, ObjectRef body);
+    // Constants are interned when interner is given
+    Code(TypeRef type, ObjectRef header, ObjectRef body, ConstInterner* interner = nullptr);
     static const unsigned int npos = -1;
-    static std::shared_ptr<const Code> from_file(std::string fname);
-    static std::shared_ptr<const Code> from_string(std::string code);
+    static std::shared_ptr<const Code> from_file(std::string fname, ConstInterner* interner = nullptr);
+    static std::shared_ptr<const Code> from_string(std::string code, ConstInterner* interner = nullptr);
 
     void print(std::ostream& stream) const;
+    // Checks that every instruction is known and that its const index or jump target is in range, so that
+    // execution can index without checking
+    void validate() const;
     static TypeRef type;
     unsigned int lineno_for_position(unsigned int position) const;
     std::string filename() const;
     std::string modulename() const;
 
     friend class Frame;
+    friend class Function;
 };
 
 class Signature : public Object {
@@ -71,17 +120,26 @@ public:
     friend class Function;
 };
 
+// Variables by name. The transparent comparator lets lookups take a string_view, such as a name constant's.
+using EnvMap = std::map<std::string, BaseObjectRef, std::less<>>;
+
 class Function : public Object {
     std::shared_ptr<const Code> code;
     int offset;
     std::shared_ptr<const Signature> signature_;
-    std::map<std::string, BaseObjectRef> env;
+    EnvMap env;
 public:
-    Function(TypeRef type, std::shared_ptr<const Code> code, int offset, std::shared_ptr<const Signature> signature, std::map<std::string, BaseObjectRef> env);
+    Function(TypeRef type, std::shared_ptr<const Code> code, int offset, std::shared_ptr<const Signature> signature, EnvMap env);
     BaseObjectRef call(const std::vector<ObjectRef>& args) const override;
     std::string to_str() const override;
     static TypeRef type;
     std::shared_ptr<const Signature> signature() const { return signature_; }
+    // Whether, judging from its code, calling this can't reach the execution engine or write output: it reads none
+    // of the engine's builtins or print, no thunks, and the same holds for the functions it defines or reads from its
+    // env. Names reached through attributes aren't followed, so callers still need the runtime check (serial_only).
+    bool pure() const;
+private:
+    bool pure(std::set<std::pair<const Code*, int>>& seen) const;
 };
 
 std::string get_line_of_file(std::string fname, int lineno, bool trim = false);
@@ -8,24 +8,26 @@
 
 TypeRef Exception::type = create<Type>("Exception", Type::basevec{Object::type});
 
-Exception::Exception(TypeRef type, ObjectRef reason, std::vector< std::pair< std::string, int > > stack_trace) : Object(type), reason_(reason), stack_trace_(stack_trace) {
+Exception::Exception(TypeRef type, ObjectRef reason, std::shared_ptr<const StackEntry> stack_trace) : Object(type), reason_(reason), stack_trace_(stack_trace) {
 }
 
 std::string Exception::to_str() const {
+    std::vector<const StackEntry*> entries;
+    for (auto entry = stack_trace_.get(); entry; entry = entry->previous.get()) {
+        entries.push_back(entry);
+    }
     std::stringstream ss;
     ss << "Traceback (most recent call last):\n";
-    for (auto& [fname, lineno] : stack_trace_) {
-        ss << "  File \"" << fname << "\", line " << lineno << "\n";
-        ss << "    " << get_line_of_file(fname, lineno, true) << "\n";
+    for (auto iter = entries.rbegin(); iter != entries.rend(); ++iter) {
+        ss << "  File \"" << (*iter)->fname << "\", line " << (*iter)->lineno << "\n";
+        ss << "    " << get_line_of_file((*iter)->fname, (*iter)->lineno, true) << "\n";
     }
     ss << reason_->to_str();
     return ss.str();
 }
 
 std::shared_ptr<const Exception> Exception::append_stack(std::string fname, int lineno) const {
-    auto copy = stack_trace_;
-    copy.emplace_back(fname, lineno);
-    return create<Exception>(reason_, copy);
+    return create<Exception>(reason_, std::make_shared<const StackEntry>(StackEntry{std::move(fname), lineno, stack_trace_}));
 }
 
 
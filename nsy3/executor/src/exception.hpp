@@ -3,11 +3,18 @@
 
 #include "object.hpp"
 
+// A traceback entry, linking to the one appended before it. Entries are shared, so appending doesn't copy the trace.
+struct StackEntry {
+    std::string fname;
+    int lineno;
+    std::shared_ptr<const StackEntry> previous;
+};
+
 class Exception : public Object {
     ObjectRef reason_;
-    std::vector<std::pair<std::string, int>> stack_trace_;
+    std::shared_ptr<const StackEntry> stack_trace_;
 public:
-    Exception(TypeRef type, ObjectRef reason, std::vector<std::pair<std::string, int>> stack_trace = {});
+    Exception(TypeRef type, ObjectRef reason, std::shared_ptr<const StackEntry> stack_trace = nullptr);
     static TypeRef type;
     std::string to_str() const override;
     [[ noreturn ]] void raise() const;
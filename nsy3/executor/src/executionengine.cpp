@@ -5,9 +5,21 @@
 #include "frame.hpp"
 #include "builtins.hpp"
 #include "serialisation.hpp"
+#include "resultstore.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
 
 #include <iostream>
 #include <sstream>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 namespace {
     std::ostream& operator<<(std::ostream& s, const DollarName& v) {
@@ -19,38 +31,95 @@ namespace {
         }
         return s;
     }
+
+    DollarName split_dollar_name(const std::string& name) {
+        DollarName res;
+        std::string::size_type start = 0, end;
+        while ((end = name.find('.', start)) != std::string::npos) {
+            res.push_back(name.substr(start, end - start));
+            start = end + 1;
+        }
+        res.push_back(name.substr(start));
+        return res;
+    }
+
+    std::string join_dollar_name(const DollarName& name) {
+        std::stringstream ss;
+        ss << name;
+        return ss.str();
+    }
+
+    std::pair<time_t, long> file_mtime(const std::string& fname) {
+        struct stat st;
+        if (stat(fname.c_str(), &st)) {
+            return {0, 0};
+        }
+        return {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    }
+
+    bool same_value(const ObjectRef& a, const ObjectRef& b) {
+        try {
+            return a->eq(b);
+        }
+        catch (const ExceptionContainer&) {
+            return false;
+        }
+    }
+
+    template<class T, class F> void filter_thunks(T& m, F keep) {
+        for (auto iter = m.begin(); iter != m.end();) {
+            auto& thunks = iter->second;
+            thunks.erase(std::remove_if(thunks.begin(), thunks.end(), [&](const auto& thunk) { return !keep(thunk); }), thunks.end());
+            if (thunks.size()) {
+                ++iter;
+            }
+            else {
+                m.erase(iter++);
+            }
+        }
+    }
 }
 
 ExecutionEngine::ExecutionEngine() {
-    env_additions = {
+    std::map<std::string, ObjectRef> env_additions = {
         {"test_thunk", create<BuiltinFunction>(method_and_bind(this, &ExecutionEngine::test_thunk))},
         {"import", create<BuiltinFunction>(method_and_bind(this, &ExecutionEngine::import_))},
         {"$?", create<BuiltinFunction>(method_and_bind(this, &ExecutionEngine::dollar_get))},
         {"$=", create<BuiltinFunction>(method_and_bind(this, &ExecutionEngine::dollar_set))},
         {"alias", create<BuiltinFunction>(method_and_bind(this, &ExecutionEngine::make_alias))},
         {"subs", create<BuiltinFunction>([this](DollarName name) {
+            serial_only();
             return create<SubIter>(this, name);
         })}
     };
+    std::map<std::string, BaseObjectRef> base(builtins.begin(), builtins.end());
+    for (auto& item : env_additions) {
+        base[item.first] = item.second;
+    }
+    base_env = create<BaseEnv>(base);
 }
 
 BaseObjectRef ExecutionEngine::import_(std::string name) {
+    serial_only();
+    module_imports[*current_module].insert(name);
     return modules.at(name);
 }
 
 BaseObjectRef ExecutionEngine::test_thunk(std::string name) {
+    serial_only();
     auto tt = std::make_shared<TestThunk>(this, name);
     state.test_thunks.push_back(tt);
     return tt;
 }
 
 BaseObjectRef ExecutionEngine::dollar_get(DollarName name, unsigned int flags) {
+    serial_only();
     name = dealias(name);
     auto iter = state.dollar_values.find(name);
     if (iter != state.dollar_values.end()) {
         return iter->second;
     }
-    std::cerr << "Making get for " << name << std::endl;
+    TRACE(DOLLAR, 2, MAKING_GET, name);
     auto thunk = std::make_shared<GetThunk>(this, name, flags);
     state.get_thunks[name].push_back(thunk);
     return thunk;
@@ -76,7 +145,8 @@ bool is_prefix_of(const DollarName& pref, const DollarName& name) {
 }
 
 BaseObjectRef ExecutionEngine::dollar_set(DollarName name, ObjectRef value, unsigned int flags) {
-    std::cerr << "Making set for " << name << std::endl;
+    serial_only();
+    TRACE(DOLLAR, 2, MAKING_SET, name);
     name = dealias(name);
     auto thunk = std::make_shared<SetThunk>(this, name, value, flags);
     state.set_thunks[name].push_back(thunk);
@@ -98,8 +168,10 @@ template<class T> T alias_move(const DollarName& alias, T& m, ExecutionEngine* t
 }
 
 BaseObjectRef ExecutionEngine::make_alias(DollarName name, DollarName alias) {
-    std::cerr << "Alias " << alias << " = " << name << std::endl;
+    serial_only();
+    TRACE(DOLLAR, 1, ALIAS, alias, name);
     state.aliases[alias] = name;
+    aliasing_modules.insert(*current_module);
     for (auto& item : state.dollar_values) {
         if (is_prefix_of(alias, item.first)) {
             // Cause conflict deliberately
@@ -127,17 +199,47 @@ DollarName ExecutionEngine::dealias(const DollarName& name) {
 }
 
 void ExecutionEngine::finish() {
+    resolve();
+    if (store) {
+        std::map<std::string, ObjectRef> values;
+        for (auto& dn : results()) {
+            values[join_dollar_name(dn.first)] = dn.second;
+        }
+        write_result_store(*store, values);
+    }
+    if (stream) {
+        write_record({create<String>("done")});
+        stream->flush();
+    }
+    else if (!store) {
+        write_results();
+    }
+}
+
+void ExecutionEngine::resolve() {
     initial_state = state;
-    while (state.get_thunks.size() || state.set_thunks.size() || state.sub_thunks.size()) {
+    std::set<DollarName> demanded_outputs;
+    while (true) {
+        // Without requested outputs every name with sets is demanded, which the pickers take as a null set
+        const std::set<DollarName>* demanded = nullptr;
+        if (outputs) {
+            demanded_outputs = demanded_names();
+            demanded = &demanded_outputs;
+        }
+        bool any_demanded = demanded ? !demanded->empty() : !state.set_thunks.empty();
+        auto resets_before = resets;
+        if (!state.get_thunks.size() && !any_demanded && !state.sub_thunks.size()) {
+            break;
+        }
         bool done_something = false;
-        if (state.set_thunks.size()) {
-            auto picked_name = pick_next_dollar_name();
+        if (any_demanded) {
+            auto picked_name = pick_next_dollar_name(demanded);
             if (picked_name.size()) {
-                std::cerr << "Resolving " << picked_name << std::endl;
+                TRACE(RESOLVE, 1, RESOLVING, picked_name);
 
                 resolve_dollar(picked_name);
 
-                std::cerr << "Done." << std::endl;
+                TRACE(RESOLVE, 1, DONE);
                 done_something = true;
             }
         }
@@ -147,39 +249,421 @@ void ExecutionEngine::finish() {
         notify_thunks();
         check_consistency();
         if (!done_something) {
-            auto dummy_name = pick_dummy_name();
+            // A reset replaces the state the demanded names were worked out from
+            if (demanded && resets != resets_before) {
+                demanded_outputs = demanded_names();
+            }
+            auto dummy_name = pick_dummy_name(demanded);
             resolve_dummy(dummy_name);
         }
+        if (stream) {
+            stream->flush();
+        }
     }
+    prune_set_thunks();
     while (state.test_thunks.size()) {
         while (state.test_thunks.size()) {
             auto tt = state.test_thunks.back();
-            std::cerr << "Resolving " << tt->to_str() << std::endl;
+            TRACE(RESOLVE, 2, RESOLVING, tt->to_str());
             state.test_thunks.pop_back();
             tt->finalize(create<Integer>(1));
         }
         notify_thunks();
     }
 
-    std::cerr << "Finished!" << std::endl;
+    TRACE(RESOLVE, 1, FINISHED);
     for (auto& dn : state.dollar_values) {
-        std::cerr << dn.first << " = " << dn.second << std::endl;
+        TRACE(RESOLVE, 2, VALUE, dn.first, dn.second);
     }
-    std::cerr << "Resolved in " << resets << " resets" << std::endl;
-    std::cout << "=== MARKER ===" << std::endl;
-    ObjectRefMap m;
+    TRACE(RESOLVE, 1, RESOLVED_IN, resets);
+}
+
+std::map<DollarName, ObjectRef> ExecutionEngine::results() {
+    std::map<DollarName, ObjectRef> res;
     for (auto& dn : state.dollar_values) {
-        if (!dn.second) {
+        if (dn.second && is_output(dn.first)) {
+            res.insert(dn);
+        }
+    }
+    return res;
+}
+
+void ExecutionEngine::write_results() {
+    // Serialised straight from the dollar values as a Dict of dotted names, without building one
+    std::size_t count = 0;
+    for (auto& dn : state.dollar_values) {
+        count += dn.second && is_output(dn.first);
+    }
+    Serialiser serialiser;
+    serialiser.begin_dict(count);
+    std::string name;
+    for (auto& dn : state.dollar_values) {
+        if (!dn.second || !is_output(dn.first)) {
             continue;
         }
-        std::stringstream ss;
-        ss << dn.first;
-        m[create<String>(ss.str())] = dn.second;
+        name.clear();
+        for (auto& part : dn.first) {
+            if (name.size()) {
+                name += '.';
+            }
+            name += part;
+        }
+        serialiser.write_string(name);
+        serialiser.write(dn.second);
     }
-    serialize_to_file(std::cout, create<Dict>(m));
+    std::cout << "=== MARKER ===" << std::endl;
+    serialiser.write_to(STDOUT_FILENO);
     std::cout << "=== END MARKER ===" << std::endl;
 }
 
+void ExecutionEngine::write_record(std::vector<ObjectRef> record) {
+    Serialiser serialiser;
+    serialiser.begin_list(record.size());
+    for (auto& item : record) {
+        serialiser.write(item);
+    }
+    // Flushed by resolve() after each pass, and by finish()
+    stream->write(serialiser.data().data(), serialiser.data().size());
+}
+
+int ExecutionEngine::finish_variants(ObjectRef runspec, unsigned int jobs) {
+    // Everything up to here (loading and the initial execution of all modules) is shared between the variants, each
+    // variant gets a copy-on-write fork of the engine, injects its dollar values and resolves as normal.
+    auto runspec_dict = convert_ptr<Dict>(runspec);
+    auto variants = convert_ptr<List>(runspec_dict->get().at(create<String>("variants")))->get();
+    // Its workers wouldn't exist in the children. A child that needs a pool makes its own.
+    ThreadPool::release_shared();
+    struct Running {
+        std::string id;
+        pid_t pid;
+        int fd;
+        std::string output;
+        int status = 0;
+        bool done = false;
+    };
+    // In order of starting, which is the order their output is written in. Children that have finished stay until
+    // the ones before them are written, but no longer take up a job.
+    std::deque<Running> running;
+    unsigned int live = 0;
+    int failures = 0;
+
+    // Reads whatever any running child has written, so that none of them blocks on a full pipe
+    auto pump = [&]() {
+        std::vector<pollfd> fds;
+        std::vector<Running*> owners;
+        for (auto& item : running) {
+            if (!item.done) {
+                fds.push_back({item.fd, POLLIN, 0});
+                owners.push_back(&item);
+            }
+        }
+        if (fds.empty()) {
+            return;
+        }
+        while (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno != EINTR) {
+                throw std::runtime_error("Could not wait for variant output");
+            }
+        }
+        char buf[4096];
+        for (std::size_t i = 0; i < fds.size(); ++i) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            auto& item = *owners[i];
+            auto n = read(item.fd, buf, sizeof(buf));
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                throw std::runtime_error("Could not read variant output");
+            }
+            if (n > 0) {
+                item.output.append(buf, n);
+                continue;
+            }
+            close(item.fd);
+            while (waitpid(item.pid, &item.status, 0) < 0 && errno == EINTR);
+            item.done = true;
+            --live;
+        }
+    };
+
+    auto report = [&]() {
+        while (!running.empty() && running.front().done) {
+            auto& item = running.front();
+            if (!WIFEXITED(item.status) || WEXITSTATUS(item.status)) {
+                std::cerr << "Variant " << item.id << " failed" << std::endl;
+                ++failures;
+            }
+            std::cout << "=== VARIANT " << item.id << " ===" << std::endl;
+            std::cout << item.output;
+            std::cout << "=== END VARIANT " << item.id << " ===" << std::endl;
+            running.pop_front();
+        }
+    };
+
+    for (auto& variant : variants) {
+        auto variant_list = convert<std::vector<ObjectRef>>(variant);
+        if (variant_list.size() != 2) {
+            throw std::runtime_error("Variants must be [id, values] pairs");
+        }
+        auto id = convert<std::string>(variant_list[0]);
+        auto values = convert_ptr<Dict>(variant_list[1]);
+
+        while (live >= std::max(jobs, 1u)) {
+            pump();
+            report();
+        }
+
+        int fds[2];
+        if (pipe(fds)) {
+            throw std::runtime_error("Could not create pipe for variant");
+        }
+        // Otherwise buffered output is duplicated in the child
+        std::cout.flush();
+        std::cerr.flush();
+        auto pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error("Could not fork for variant");
+        }
+        if (!pid) {
+            close(fds[0]);
+            for (auto& item : running) {
+                if (!item.done) {
+                    close(item.fd);
+                }
+            }
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[1]);
+            int status = 0;
+            try {
+                for (auto& item : values->get()) {
+                    dollar_set(split_dollar_name(convert<std::string>(item.first)), item.second, 0);
+                }
+                finish();
+            }
+            catch (const ExceptionContainer& exc) {
+                std::cerr << exc.exception->to_str() << std::endl;
+                status = 1;
+            }
+            catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                status = 1;
+            }
+            std::cout.flush();
+            std::cerr.flush();
+            _exit(status);
+        }
+        close(fds[1]);
+        running.push_back({id, pid, fds[0], {}});
+        ++live;
+    }
+    while (!running.empty()) {
+        pump();
+        report();
+    }
+    return failures;
+}
+
+void ExecutionEngine::watch(ObjectRef runspec, unsigned int interval) {
+    // Taken before loading, so that changes made while the first run is going are picked up
+    std::map<std::string, std::pair<time_t, long>> mtimes;
+    for (auto item : convert_ptr<List>(convert_ptr<Dict>(runspec)->get().at(create<String>("files")))->get()) {
+        auto fname = convert<std::string>(item);
+        mtimes[fname] = file_mtime(fname);
+    }
+    exec_runspec(runspec);
+    resolve();
+    write_results();
+    std::cout.flush();
+
+    auto previous = results();
+    auto attempt = [](auto f) {
+        try {
+            f();
+            return true;
+        }
+        catch (const ExceptionContainer& exc) {
+            std::cerr << exc.exception->to_str() << std::endl;
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+        return false;
+    };
+    // Whether the state after loading can be reused by the next run
+    bool reusable = true;
+
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        std::set<std::string> changed;
+        for (auto& item : mtimes) {
+            auto mtime = file_mtime(item.first);
+            if (mtime != item.second) {
+                item.second = mtime;
+                changed.insert(item.first);
+            }
+        }
+        if (!changed.size()) {
+            continue;
+        }
+
+        bool ok = reusable && attempt([&]() { rerun(changed); });
+        if (!ok) {
+            TRACE(EXEC, 1, RERUNNING_EVERYTHING);
+            ok = attempt([&]() {
+                reset();
+                exec_runspec(runspec);
+                resolve();
+            });
+        }
+        reusable = ok;
+        if (!ok) {
+            std::cout << "=== ERROR ===" << std::endl;
+            continue;
+        }
+
+        auto current = results();
+        ObjectRefMap changed_values, sources;
+        std::vector<ObjectRef> removed;
+        for (auto& item : current) {
+            auto iter = previous.find(item.first);
+            if (iter != previous.end() && same_value(iter->second, item.second)) {
+                continue;
+            }
+            auto name = create<String>(join_dollar_name(item.first));
+            changed_values[name] = item.second;
+            std::vector<ObjectRef> modules;
+            for (auto& module : state.provenance[item.first]) {
+                modules.push_back(create<String>(module));
+            }
+            sources[name] = create<List>(modules);
+        }
+        for (auto& item : previous) {
+            if (!current.count(item.first)) {
+                removed.push_back(create<String>(join_dollar_name(item.first)));
+            }
+        }
+        std::cout << "=== DIFF ===" << std::endl;
+        serialize_to_file(std::cout, create<Dict>(ObjectRefMap{
+            {create<String>("changed"), create<Dict>(changed_values)},
+            {create<String>("removed"), create<List>(removed)},
+            {create<String>("sources"), create<Dict>(sources)}
+        }));
+        std::cout << "=== END DIFF ===" << std::endl;
+        previous = std::move(current);
+    }
+}
+
+void ExecutionEngine::rerun(const std::set<std::string>& changed_files) {
+    // Only the changed modules and the modules importing them are executed again. Everything else is taken from the
+    // state after the previous load: module execution does not read dollar values, so it only depends on imports.
+    // Changed files are loaded and validated first, as on the initial load, so that a bad one changes nothing.
+    interner.clear();
+    std::map<std::string, std::shared_ptr<const Code>> reloaded;
+    for (auto& item : loaded_files) {
+        if (changed_files.count(item.first)) {
+            auto code = code_loader(item.first, &interner);
+            code->validate();
+            reloaded[item.first] = code;
+        }
+    }
+    std::set<std::string> affected;
+    for (auto& item : loaded_files) {
+        if (changed_files.count(item.first)) {
+            affected.insert(item.second->modulename());
+        }
+    }
+    if (conclusion_code) {
+        affected.insert(conclusion_code->modulename());
+    }
+    for (bool grown = true; grown;) {
+        grown = false;
+        for (auto& item : module_imports) {
+            if (affected.count(item.first)) {
+                continue;
+            }
+            for (auto& name : item.second) {
+                if (affected.count(name)) {
+                    affected.insert(item.first);
+                    grown = true;
+                    break;
+                }
+            }
+        }
+    }
+    for (auto& module : aliasing_modules) {
+        if (affected.count(module)) {
+            throw std::runtime_error("Cannot rerun " + module + " incrementally, it makes aliases");
+        }
+    }
+    for (auto& module : affected) {
+        TRACE(EXEC, 1, RERUNNING, module);
+        module_imports.erase(module);
+    }
+
+    state = initial_state;
+    auto keep = [&](const auto& thunk) {
+        return !affected.count(thunk->module());
+    };
+    state.test_thunks.erase(std::remove_if(state.test_thunks.begin(), state.test_thunks.end(), [&](const auto& thunk) { return !keep(thunk); }), state.test_thunks.end());
+    filter_thunks(state.get_thunks, keep);
+    filter_thunks(state.set_thunks, keep);
+    filter_thunks(state.sub_thunks, keep);
+    for (auto iter = state.thunk_subscriptions.begin(); iter != state.thunk_subscriptions.end();) {
+        if (keep(iter->first)) {
+            ++iter;
+        }
+        else {
+            state.thunk_subscriptions.erase(iter++);
+        }
+    }
+    filter_thunks(state.thunk_subscriptions, keep);
+    for (auto iter = state.thunk_results.begin(); iter != state.thunk_results.end();) {
+        if (keep(iter->first)) {
+            ++iter;
+        }
+        else {
+            state.thunk_results.erase(iter++);
+        }
+    }
+    resets = 0;
+
+    for (auto& item : loaded_files) {
+        if (affected.count(item.second->modulename())) {
+            modules[item.second->modulename()] = std::make_shared<ModuleThunk>(this, item.second->modulename());
+        }
+    }
+    for (auto& item : loaded_files) {
+        if (!affected.count(item.second->modulename())) {
+            continue;
+        }
+        if (auto iter = reloaded.find(item.first); iter != reloaded.end()) {
+            item.second = iter->second;
+        }
+        exec_code(item.second);
+    }
+    if (conclusion_code) {
+        exec_code(conclusion_code);
+    }
+    // The ordering learnt by previous runs is kept, which saves most of the resets
+    resolve();
+}
+
+void ExecutionEngine::reset() {
+    modules.clear();
+    module_imports.clear();
+    aliasing_modules.clear();
+    loaded_files.clear();
+    conclusion_code.reset();
+    interner.clear();
+    ordering.clear();
+    outputs.reset();
+    state = initial_state = ExecutionState();
+    resets = 0;
+}
+
 bool ExecutionEngine::finalize_abandoned_get_thunks() {
     bool done_something = false;
     for (auto iter = state.get_thunks.begin(); iter != state.get_thunks.end();) {
@@ -248,8 +732,83 @@ bool ExecutionEngine::finalize_abandoned_sub_thunks() {
     return done_something;
 }
 
-DollarName ExecutionEngine::pick_next_dollar_name() {
-    for (auto item : state.set_thunks) {
+std::set<DollarName> ExecutionEngine::demanded_names() {
+    // Only used with requested outputs. A name with sets is needed if it is an output, if anything is waiting to read
+    // it (a get, or a subs iteration over a parent), or if a needed name has been ordered after it.
+    std::vector<DollarName> dealiased;
+    for (auto& output : *outputs) {
+        dealiased.push_back(dealias(output));
+    }
+    std::set<DollarName> demanded, visited;
+    std::vector<DollarName> to_check;
+    for (auto& item : state.set_thunks) {
+        bool needed = std::any_of(dealiased.begin(), dealiased.end(), [&](const DollarName& output) {
+            return is_prefix_of(output, item.first);
+        });
+        for (DollarName parent(item.first.begin(), --item.first.end()); !needed && parent.size(); parent.pop_back()) {
+            needed = state.sub_thunks.count(parent);
+        }
+        if (needed) {
+            to_check.push_back(item.first);
+        }
+    }
+    for (auto& item : state.get_thunks) {
+        to_check.push_back(item.first);
+    }
+    while (to_check.size()) {
+        auto check = std::move(to_check.back());
+        to_check.pop_back();
+        if (!visited.insert(check).second) {
+            continue;
+        }
+        if (state.set_thunks.count(check)) {
+            demanded.insert(check);
+        }
+        auto iter = ordering.find(check);
+        if (iter != ordering.end()) {
+            to_check.insert(to_check.end(), iter->second.begin(), iter->second.end());
+        }
+    }
+    return demanded;
+}
+
+bool ExecutionEngine::is_output(const DollarName& name) {
+    if (!outputs) {
+        return true;
+    }
+    for (auto& output : *outputs) {
+        if (is_prefix_of(dealias(output), name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ExecutionEngine::prune_set_thunks() {
+    // Nothing needs these, so they and everything waiting on them are dropped rather than resumed. Anything a
+    // continuation would get or set could no longer be resolved.
+    std::vector<std::shared_ptr<const Thunk>> pruned;
+    for (auto& item : state.set_thunks) {
+        TRACE(RESOLVE, 1, PRUNING, item.first);
+        pruned.insert(pruned.end(), item.second.begin(), item.second.end());
+    }
+    state.set_thunks.clear();
+    while (pruned.size()) {
+        auto thunk = std::move(pruned.back());
+        pruned.pop_back();
+        thunk->abandon();
+        if (auto iter = state.thunk_subscriptions.find(thunk); iter != state.thunk_subscriptions.end()) {
+            pruned.insert(pruned.end(), iter->second.begin(), iter->second.end());
+            state.thunk_subscriptions.erase(iter);
+        }
+    }
+}
+
+DollarName ExecutionEngine::pick_next_dollar_name(const std::set<DollarName>* demanded) {
+    for (auto& item : state.set_thunks) {
+        if (demanded && !demanded->count(item.first)) {
+            continue;
+        }
         bool found_initial = false;
         for (auto& thunk : item.second) {
             if (!(thunk->flags & ~static_cast<unsigned int>(DollarSetFlags::DEFAULT))) {
@@ -274,14 +833,19 @@ DollarName ExecutionEngine::pick_next_dollar_name() {
     return {};
 }
 
-DollarName ExecutionEngine::pick_dummy_name() {
+DollarName ExecutionEngine::pick_dummy_name(const std::set<DollarName>* demanded) {
     std::vector<DollarName> to_check;
-    for (auto& item : state.set_thunks) {
-        to_check.push_back(item.first);
+    if (demanded) {
+        to_check.assign(demanded->begin(), demanded->end());
+    }
+    else {
+        for (auto& item : state.set_thunks) {
+            to_check.push_back(item.first);
+        }
     }
     for (auto& item : state.sub_thunks) {
         to_check.push_back(item.first);
-        std::cerr << "DN " << item.first << std::endl;
+        TRACE(RESOLVE, 2, DUMMY_NAME, item.first);
     }
     while (to_check.size()) {
         auto check = std::move(to_check.back());
@@ -373,19 +937,21 @@ void ExecutionEngine::resolve_dollar(DollarName name) {
         bool has_nondefault_set = false;
         for (auto iter = thunks.begin(); iter != thunks.end();) {
             if (!(*iter)->flags) {
-                std::cerr << "$Exec " << (*iter)->to_str() << std::endl;
+                TRACE(RESOLVE, 2, EXEC_THUNK, (*iter)->to_str());
                 if (has_nondefault_set) {
                     throw std::runtime_error("Multiple non-default initial sets");
                 }
                 value = (*iter)->value;
+                state.provenance[name] = {(*iter)->module()};
                 (*iter)->finalize(create<Integer>(1));
                 iter = thunks.erase(iter);
                 has_nondefault_set = true;
             }
             else if ((*iter)->flags & static_cast<unsigned int>(DollarSetFlags::DEFAULT)) {
-                std::cerr << "$Exec " << (*iter)->to_str() << std::endl;
+                TRACE(RESOLVE, 2, EXEC_THUNK, (*iter)->to_str());
                 if (!has_nondefault_set) {
                     value = (*iter)->value;
+                    state.provenance[name] = {(*iter)->module()};
                 }
                 (*iter)->finalize(create<Integer>(1));
                 iter = thunks.erase(iter);
@@ -399,7 +965,7 @@ void ExecutionEngine::resolve_dollar(DollarName name) {
     // Modifying sets
     {
         while (true) {
-            std::cerr << "RML" << std::endl;
+            TRACE(RESOLVE, 2, RML);
             notify_thunks();
             auto& set_thunks = state.set_thunks[name];
             if (set_thunks.size()) {
@@ -407,8 +973,9 @@ void ExecutionEngine::resolve_dollar(DollarName name) {
                 if (!(thunk->flags & static_cast<unsigned int>(DollarSetFlags::MODIFICATION))) {
                     throw std::runtime_error("Non-modification after initial set");
                 }
-                std::cerr << "$Exec " << thunk->to_str() << std::endl;
+                TRACE(RESOLVE, 2, EXEC_THUNK, thunk->to_str());
                 value = thunk->value;
+                state.provenance[name].insert(thunk->module());
                 thunk->finalize(NoneType::none);
                 set_thunks.erase(set_thunks.begin());
                 continue;
@@ -416,7 +983,7 @@ void ExecutionEngine::resolve_dollar(DollarName name) {
             bool found_get = false;
             auto& get_thunks = state.get_thunks[name];
             for (auto iter = get_thunks.begin(); iter != get_thunks.end();) {
-                std::cerr << "$Final " << (*iter)->to_str() << std::endl;
+                TRACE(RESOLVE, 2, FINAL_THUNK, (*iter)->to_str());
                 if ((*iter)->flags & static_cast<unsigned int>(DollarGetFlags::PARTIAL)) {
                     (*iter)->finalize(value);
                     iter = get_thunks.erase(iter);
@@ -433,15 +1000,18 @@ void ExecutionEngine::resolve_dollar(DollarName name) {
             break;
         }
     }
-    std::cerr << "RMLe" << std::endl;
+    TRACE(RESOLVE, 2, RMLE);
     notify_thunks();
     state.set_thunks.erase(name);
 
     // Handle gets
     state.dollar_values[name] = value;
+    if (stream && value && is_output(name)) {
+        write_record({create<String>("value"), create<String>(join_dollar_name(name)), value});
+    }
 
     for (auto& thunk : state.get_thunks[name]) {
-        std::cerr << "$Final " << thunk->to_str() << std::endl;
+        TRACE(RESOLVE, 2, FINAL_THUNK, thunk->to_str());
         thunk->finalize(value);
     }
     state.get_thunks.erase(name);
@@ -449,7 +1019,7 @@ void ExecutionEngine::resolve_dollar(DollarName name) {
 }
 
 void ExecutionEngine::resolve_dummy(DollarName name) {
-    std::cerr << "Dummy resolving " << name << std::endl;
+    TRACE(RESOLVE, 1, DUMMY_RESOLVING, name);
     state.resolution_order.push_back(name);
     state.dollar_values[name] = {};
 }
@@ -465,7 +1035,7 @@ void ExecutionEngine::notify_thunks() {
                 auto thunks = std::move(iter->second);
                 state.thunk_subscriptions.erase(iter++);
                 for (auto thunk : thunks) {
-                    std::cerr << "  notifying " << thunk->to_str() << std::endl;
+                    TRACE(NOTIFY, 2, NOTIFYING, thunk->to_str());
                     thunk->notify(result_iter->second);
                 }
                 done = false;
@@ -498,7 +1068,7 @@ void ExecutionEngine::check_consistency() {
         }
 //         std::cerr << "Checking " << item.first << std::endl;
         if (state.dollar_values.count(item.first)) {
-            std::cerr << "Conflict: " << item.first << " already set, but new set revealed by " << state.resolution_order.back() << std::endl;
+            TRACE(RESET, 1, CONFLICT, item.first, state.resolution_order.back());
             if (state.resolution_order.back() == item.first) {
                 throw std::runtime_error("Circular self dependency");
             }
@@ -507,7 +1077,7 @@ void ExecutionEngine::check_consistency() {
         }
         DollarName parent(item.first.begin(), --item.first.end());
         if (parent.size() && state.dollar_values.count(parent)) {
-            std::cerr << "Conflict: " << parent << " already (dummy) set, but new child " << item.first << " revealed by " << state.resolution_order.back() << std::endl;
+            TRACE(RESET, 1, CONFLICT_DUMMY, parent, item.first, state.resolution_order.back());
             ordering[parent].push_back(state.resolution_order.back());
             conflict = true;
         }
@@ -517,33 +1087,37 @@ void ExecutionEngine::check_consistency() {
     }
     state = initial_state;
     ++resets;
-    std::cerr << "RESET!" << std::endl;
-    std::cerr << "Ordering now has " << ordering.size() << " items" << std::endl;
-    for (auto& item : ordering) {
-        std::cerr << "    " << item.first << ": ";
-        for (auto& name : item.second) {
-            std::cerr << name << ", ";
+    TRACE(RESET, 1, RESET);
+    if (stream) {
+        write_record({create<String>("reset")});
+    }
+    TRACE(RESET, 1, ORDERING_SIZE, ordering.size());
+    if (trace::enabled(trace::Category::RESET, 2)) {
+        for (auto& item : ordering) {
+            std::ostringstream names;
+            for (auto& name : item.second) {
+                names << name << ", ";
+            }
+            TRACE(RESET, 2, ORDERING_ITEM, item.first, names.str());
         }
-        std::cerr << std::endl;
     }
 }
 
 void ExecutionEngine::exec_code(std::shared_ptr<const Code> code) {
-    code->print(std::cerr);
-    std::map<std::string, BaseObjectRef> start_env;
-    for (auto& item : builtins) {
-        start_env[item.first] = item.second;
-    }
-    for (auto& item : env_additions) {
-        start_env[item.first] = item.second;
+    if (disassemble) {
+        code->print(std::cerr);
     }
-    std::cerr << "Executing " << code->filename() << std::endl;
+    EnvMap start_env = {{"__builtins__", base_env}};
+    TRACE(EXEC, 1, EXECUTING, code->filename());
+    ExecutingModule executing(this, module_name(code->modulename()));
     auto frame = create<Frame>(code, 0, start_env);
     auto end_env = frame->execute();
     auto module = create<Module>(code->modulename(), end_env);
     auto thunk_iter = modules.find(code->modulename());
     if (thunk_iter != modules.end()) {
-        std::dynamic_pointer_cast<const ModuleThunk>(thunk_iter->second)->finalize(module);
+        if (auto thunk = std::dynamic_pointer_cast<const ModuleThunk>(thunk_iter->second)) {
+            thunk->finalize(module);
+        }
     }
     modules[code->modulename()] = module;
 }
@@ -554,15 +1128,57 @@ void ExecutionEngine::exec_runspec(ObjectRef runspec) {
     for (auto module_ : convert<std::vector<std::string>>(runspec_dict->get().at(create<String>("modules")))) {
         modules[module_] = std::make_shared<ModuleThunk>(this, module_);
     }
-    for (auto item : convert_ptr<List>(runspec_dict->get().at(create<String>("files")))->get()) {
-        exec_code(Code::from_file(convert<std::string>(item)));
+    // Files are loaded and validated on a pool while the ones before them execute. The pool is gone by the time
+    // finish_variants forks.
+    auto files = convert<std::vector<std::string>>(runspec_dict->get().at(create<String>("files")));
+    {
+        ThreadPool pool(std::min<std::size_t>(files.size(), ThreadPool::default_threads()));
+        std::vector<std::future<std::shared_ptr<const Code>>> pending;
+        for (auto& fname : files) {
+            pending.push_back(pool.submit([this, fname]() {
+                auto code = code_loader(fname, &interner);
+                code->validate();
+                return code;
+            }));
+        }
+        for (auto i = 0u; i < files.size(); ++i) {
+            auto code = pending[i].get();
+            loaded_files.emplace_back(files[i], code);
+            exec_code(code);
+        }
+    }
+    auto outputs_value = runspec_dict->get().lookup(create<String>("outputs"));
+    bool outputs_from_conclusion = false;
+    if (outputs_value && *outputs_value != NoneType::none) {
+        if (auto name = dynamic_cast<const String*>(outputs_value->get()); name && name->get() == "conclusion") {
+            outputs_from_conclusion = true;
+            outputs.emplace();
+        }
+        else {
+            outputs.emplace();
+            for (auto& output : convert<std::vector<std::string>>(*outputs_value)) {
+                outputs->push_back(split_dollar_name(output));
+            }
+        }
     }
     auto conclusion = runspec_dict->get().at(create<String>("conclusion"));
     if (conclusion != NoneType::none) {
+        auto reads_before = state.get_thunks;
         auto bytes = std::dynamic_pointer_cast<const Bytes>(conclusion)->get();
-        exec_code(Code::from_string(std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size())));
+        conclusion_code = Code::from_string(std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size()),
+                                            &interner);
+        conclusion_code->validate();
+        exec_code(conclusion_code);
+        if (outputs_from_conclusion) {
+            for (auto& item : state.get_thunks) {
+                auto iter = reads_before.find(item.first);
+                if (iter == reads_before.end() || iter->second.size() != item.second.size()) {
+                    outputs->push_back(item.first);
+                }
+            }
+        }
     }
-    std::cerr << "Initial execution done" << std::endl;
+    TRACE(EXEC, 1, INITIAL_EXECUTION_DONE);
 }
 
 void ExecutionEngine::subscribe_thunk(std::shared_ptr<const Thunk> source, std::shared_ptr<const Thunk> dest) {
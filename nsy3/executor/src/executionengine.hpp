@@ -1,6 +1,10 @@
 #ifndef EXECUTIONENGINE_HPP
 #define EXECUTIONENGINE_HPP
 
+#include <functional>
+#include <optional>
+#include <set>
+
 #include "object.hpp"
 #include "thunk.hpp"
 #include "bytecode.hpp"
@@ -24,15 +28,37 @@ struct ExecutionState {
     std::map<DollarName, ObjectRef> dollar_values;
     std::vector<DollarName> resolution_order;
     std::map<DollarName, DollarName> aliases;
+    // The modules whose sets contributed to each resolved value
+    std::map<DollarName, std::set<std::string>> provenance;
 };
 
 
 class ExecutionEngine {
-    std::map<std::string, ObjectRef> env_additions;
+    // Builtins and the engine's own functions, shared by every module
+    ObjectRef base_env;
     std::map<std::string, BaseObjectRef> modules;
+    std::map<std::string, std::set<std::string>> module_imports;
+    std::set<std::string> aliasing_modules;
+    std::vector<std::pair<std::string, std::shared_ptr<const Code>>> loaded_files;
+    std::shared_ptr<const Code> conclusion_code;
+    // Loads the code for the files named in the runspec, interning its constants with the given interner
+    std::function<std::shared_ptr<const Code>(const std::string&, ConstInterner*)> code_loader = Code::from_file;
+    // Cleared when code is reloaded, so it doesn't keep old code's files mapped
+    ConstInterner interner;
+    // Every module name seen, so that thunks can refer to the one copy of their module's name
+    std::set<std::string> module_names = {""};
+    const std::string* current_module = &*module_names.begin();
+    // Print each module's disassembly before executing it
+    bool disassemble = false;
     VecMultiMap<DollarName, DollarName> ordering;
     ExecutionState state, initial_state;
     unsigned int resets = 0;
+    // When set, only these names (and their children) are output, and only the names they depend on are resolved
+    std::optional<std::vector<DollarName>> outputs;
+    // When set, values are written here as records as soon as they are resolved, instead of all at the end
+    std::ostream* stream = nullptr;
+    // When set, the result is written to this file as an indexed result store
+    std::optional<std::string> store;
 
     BaseObjectRef test_thunk(std::string name);
     BaseObjectRef import_(std::string name);
@@ -45,21 +71,71 @@ class ExecutionEngine {
     void resolve_dummy(DollarName name);
     void notify_thunks();
     void check_consistency();
-    DollarName pick_next_dollar_name();
-    DollarName pick_dummy_name();
+    // demanded is null when every name with sets is demanded
+    DollarName pick_next_dollar_name(const std::set<DollarName>* demanded);
+    DollarName pick_dummy_name(const std::set<DollarName>* demanded);
+    std::set<DollarName> demanded_names();
+    bool is_output(const DollarName& name);
+    void prune_set_thunks();
     bool finalize_abandoned_get_thunks();
     bool finalize_abandoned_sub_thunks();
+    void resolve();
+    std::map<DollarName, ObjectRef> results();
+    void reset();
+    void write_results();
+    void write_record(std::vector<ObjectRef> record);
+    void rerun(const std::set<std::string>& changed_files);
 public:
     ExecutionEngine();
     static TypeRef type;
     void finish();
+    int finish_variants(ObjectRef runspec, unsigned int jobs);
+    void watch(ObjectRef runspec, unsigned int interval);
+    void set_stream(std::ostream* stream) { this->stream = stream; }
+    void set_store(std::string fname) { store = std::move(fname); }
+    void set_disassemble(bool disassemble) { this->disassemble = disassemble; }
+    void set_code_loader(std::function<std::shared_ptr<const Code>(const std::string&, ConstInterner*)> loader) {
+        code_loader = std::move(loader);
+    }
     void exec_code(std::shared_ptr<const Code> code);
     void exec_runspec(ObjectRef runspec);
     void subscribe_thunk(std::shared_ptr<const Thunk> source, std::shared_ptr<const Thunk> dest);
     void finalize_thunk(std::shared_ptr<const Thunk> source, BaseObjectRef result);
     DollarName dealias(const DollarName& name);
+    const std::string* executing_module() const { return current_module; }
+    const std::string* module_name(const std::string& name) { return &*module_names.insert(name).first; }
+
+    friend struct ExecutingModule;
 
     friend class SubIter;
 };
 
+struct ExecutingModule {
+    ExecutionEngine* engine;
+    const std::string* previous;
+    ExecutingModule(ExecutionEngine* engine, const std::string* module) : engine(engine), previous(module) {
+        std::swap(engine->current_module, previous);
+    }
+    ~ExecutingModule() {
+        std::swap(engine->current_module, previous);
+    }
+};
+
+// Set on a thread while it runs one of pmap's parallel chunks. Everything that reaches the engine (dollar variables,
+// aliases, imports, thunks) or writes output calls serial_only() first, which abandons the chunk so that pmap can
+// redo the call serially.
+struct ParallelChunk {
+    static inline thread_local bool running = false;
+    ParallelChunk() { running = true; }
+    ~ParallelChunk() { running = false; }
+};
+
+struct NotParallelSafe {};
+
+inline void serial_only() {
+    if (ParallelChunk::running) {
+        throw NotParallelSafe();
+    }
+}
+
 #endif // EXECUTIONENGINE_HPP
@@ -0,0 +1,118 @@
+#ifndef FLATHASHMAP_HPP
+#define FLATHASHMAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// An insert-only hash map with open addressing. Entries live contiguously in insertion order, their full hashes in a
+// parallel array, and a power of two sized table of entry indices is probed linearly. A probe compares the stored hash
+// before calling Eq, so mismatches rarely touch the keys at all.
+template<typename K, typename V, typename Hash, typename Eq>
+class FlatHashMap {
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    std::vector<std::pair<K, V>> entries;
+    std::vector<std::size_t> hashes;
+    std::vector<uint32_t> slots;
+
+    std::size_t mask() const { return slots.size() - 1; }
+
+    // Returns the slot holding key, or the empty slot it would go in
+    std::size_t probe(const K& key, std::size_t hash) const {
+        for (auto slot = hash & mask();; slot = (slot + 1) & mask()) {
+            auto index = slots[slot];
+            if (index == EMPTY || (hashes[index] == hash && Eq{}(entries[index].first, key))) {
+                return slot;
+            }
+        }
+    }
+
+    void rehash(std::size_t capacity) {
+        std::size_t size = 8;
+        while (size < capacity + capacity / 4 + 1) {
+            size *= 2;
+        }
+        if (size <= slots.size()) {
+            return;
+        }
+        slots.assign(size, EMPTY);
+        for (uint32_t index = 0; index < entries.size(); ++index) {
+            auto slot = hashes[index] & mask();
+            while (slots[slot] != EMPTY) {
+                slot = (slot + 1) & mask();
+            }
+            slots[slot] = index;
+        }
+    }
+
+public:
+    using value_type = std::pair<K, V>;
+    using iterator = typename std::vector<value_type>::iterator;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+
+    FlatHashMap() = default;
+    FlatHashMap(std::initializer_list<value_type> init) {
+        reserve(init.size());
+        for (auto& item : init) {
+            emplace(item.first, item.second);
+        }
+    }
+
+    std::size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+
+    void reserve(std::size_t capacity) {
+        entries.reserve(capacity);
+        hashes.reserve(capacity);
+        rehash(capacity);
+    }
+
+    iterator find(const K& key) {
+        if (entries.empty()) {
+            return end();
+        }
+        auto index = slots[probe(key, Hash{}(key))];
+        return index == EMPTY ? end() : begin() + index;
+    }
+    const_iterator find(const K& key) const {
+        return const_cast<FlatHashMap*>(this)->find(key);
+    }
+    std::size_t count(const K& key) const { return find(key) != end(); }
+
+    const V& at(const K& key) const {
+        auto iter = find(key);
+        if (iter == end()) {
+            throw std::out_of_range("Key not in map");
+        }
+        return iter->second;
+    }
+
+    // Leaves an existing value alone, like std::unordered_map
+    std::pair<iterator, bool> emplace(K key, V value) {
+        auto hash = Hash{}(key);
+        // Growing first, even when key turns out to be present, means one probe finds either it or its slot
+        rehash(entries.size() + 1);
+        auto slot = probe(key, hash);
+        if (slots[slot] != EMPTY) {
+            return {begin() + slots[slot], false};
+        }
+        slots[slot] = entries.size();
+        entries.emplace_back(std::move(key), std::move(value));
+        hashes.push_back(hash);
+        return {end() - 1, true};
+    }
+
+    V& operator[](const K& key) {
+        return emplace(key, V{}).first->second;
+    }
+};
+
+#endif // FLATHASHMAP_HPP
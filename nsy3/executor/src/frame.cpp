@@ -2,8 +2,11 @@
 
 #include "functionutils.hpp"
 #include "exception.hpp"
+#include "executionengine.hpp"
+#include "trace.hpp"
 
 #include <stdexcept>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -12,20 +15,32 @@ constexpr unsigned int HALF_INT_MAX = 0xFFFF;
 int Frame::execution_debug_level = 0;
 TypeRef Frame::type = create<Type>("Frame", Type::basevec{Object::type});
 
+namespace {
+    // Cursors are stepped in place, so a saved stack gets its own copies
+    std::vector<std::pair<unsigned char, ObjectRef>> snapshot_stack(std::vector<std::pair<unsigned char, ObjectRef>> stack) {
+        for (auto& item : stack) {
+            if (item.second->obj_type() == NativeIterator::type) {
+                item.second = static_cast<const NativeIterator*>(item.second.get())->clone();
+            }
+        }
+        return stack;
+    }
+}
+
 Frame::Frame(TypeRef type, std::shared_ptr<const Code> code, unsigned int offset,
-             std::map<std::string, BaseObjectRef> env, unsigned int limit, std::vector<std::pair<unsigned char, ObjectRef>> stack,
+             EnvMap env, unsigned int limit, std::vector<std::pair<unsigned char, ObjectRef>> stack,
              std::vector<std::pair<std::string, int>> stack_trace)
-    : Object(type), code_(code), position_(offset), limit_(limit), env_(env), stack_(stack), stack_trace_(stack_trace) {
+    : Object(type), code_(code), position_(offset), limit_(limit), env_(env), stack_(snapshot_stack(std::move(stack))), stack_trace_(stack_trace) {
     this->env_["__code__"] = code;
 }
 
-inline unsigned int stack_push(unsigned char flags, const BaseObjectRef& item, const Frame& frame, const std::basic_string<unsigned char>& code,
+inline unsigned int stack_push(unsigned char flags, const BaseObjectRef& item, const Frame& frame,
                        const std::vector<ObjectRef>& consts, std::vector<std::pair<unsigned char, ObjectRef>>& stack,
-                       unsigned int& position, std::map<std::string, BaseObjectRef>& env, unsigned int skip_position, unsigned int skip_save_stack, const std::vector<unsigned int>& skipvars
+                       unsigned int& position, EnvMap& env, unsigned int skip_position, unsigned int skip_save_stack, const std::vector<unsigned int>& skipvars
                        ) {
     if (auto thunk = dynamic_cast<const Thunk*>(item.get())) {
         if (skip_position != 0xFFFF) {
-            std::cerr << "Skip from " << position << " to " << skip_position << std::endl;
+            TRACE(EXEC, 2, SKIP, position, skip_position);
             auto subframe = create<Frame>(frame.code(), position, env, skip_position, stack);
 
             auto exec_thunk = std::make_shared<ExecutionThunk>(thunk->execution_engine(), subframe);
@@ -35,9 +50,9 @@ inline unsigned int stack_push(unsigned char flags, const BaseObjectRef& item, c
                 if (!name) {
                     create<TypeError>("Name must be a string")->raise();
                 }
-                auto name_thunk = std::make_shared<NameExtractThunk>(thunk->execution_engine(), name->get());
+                auto name_thunk = std::make_shared<NameExtractThunk>(thunk->execution_engine(), std::string(name->get()));
                 exec_thunk->subscribe(name_thunk);
-                env[name->get()] = name_thunk;
+                env[std::string(name->get())] = name_thunk;
             }
             if (skip_save_stack > stack.size()) {
                 throw std::runtime_error("stack is not large enough for skip");
@@ -46,7 +61,7 @@ inline unsigned int stack_push(unsigned char flags, const BaseObjectRef& item, c
             return skip_position;
         }
         else {
-            std::cerr << "Skip from " << position << " to return" << std::endl;
+            TRACE(EXEC, 2, SKIP_TO_RETURN, position);
             auto subframe = create<Frame>(frame.code(), position, env, skip_position, stack);
             auto exec_thunk = std::make_shared<ExecutionThunk>(thunk->execution_engine(), subframe);
             auto name_thunk = std::make_shared<NameExtractThunk>(thunk->execution_engine(), "return");
@@ -62,14 +77,18 @@ inline unsigned int stack_push(unsigned char flags, const BaseObjectRef& item, c
     return position;
 }
 
-std::map<std::string, BaseObjectRef> Frame::execute() const {
-    const auto& code = code_->code;
+EnvMap Frame::execute() const {
+    auto code = code_->code;
     const auto& consts = code_->consts;
-    auto stack = stack_;
+    auto stack = snapshot_stack(stack_);
     auto position = position_;
     auto env = env_;
     unsigned int skip_position = limit_, skip_save_stack = 0;
     std::vector<unsigned int> skipvars;
+    std::shared_ptr<const BaseEnv> base_env;
+    if (auto iter = env.find("__builtins__"); iter != env.end()) {
+        base_env = std::dynamic_pointer_cast<const BaseEnv>(iter->second);
+    }
 
 
     if (execution_debug_level >= 1) {
@@ -102,7 +121,7 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                     }
                     auto obj = stack.back().second;
                     stack.pop_back();
-                    position = stack_push(0, obj->getattr(name->get()), *this, code, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
+                    position = stack_push(0, obj->getattr(std::string(name->get())), *this, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
                     break;
                 }
                 case Ops::CALL: {
@@ -114,7 +133,7 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                     stack.erase(pos_iter, stack.end());
                     auto func = stack.back().second;
                     stack.pop_back();
-                    position = stack_push(0, func->call(args), *this, code, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
+                    position = stack_push(0, func->call(args), *this, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
                     break;
                 }
                 case Ops::BINOP: {
@@ -143,7 +162,7 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                             throw;
                         }
                     }
-                    position = stack_push(0, res, *this, code, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
+                    position = stack_push(0, res, *this, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
                     break;
                 }
                 case Ops::GET: {
@@ -152,10 +171,14 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                         create<TypeError>("Name must be a string")->raise();
                     }
                     auto iter = env.find(name->get());
-                    if (iter == env.end()) {
-                        create<NameError>("Name '" + name->get() + "' is not defined")->raise();
+                    const BaseObjectRef* value = iter != env.end() ? &iter->second : nullptr;
+                    if (!value && base_env) {
+                        value = base_env->find(name->get());
                     }
-                    position = stack_push(0, iter->second, *this, code, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
+                    if (!value) {
+                        create<NameError>("Name '" + std::string(name->get()) + "' is not defined")->raise();
+                    }
+                    position = stack_push(0, *value, *this, consts, stack, position, env, skip_position, skip_save_stack, skipvars);
                     break;
                 }
                 case Ops::SET: {
@@ -163,7 +186,13 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                     if (!name) {
                         create<TypeError>("Name must be a string")->raise();
                     }
-                    env[name->get()] = stack.back().second;
+                    // Reassigning an existing variable doesn't build a key
+                    if (auto iter = env.find(name->get()); iter != env.end()) {
+                        iter->second = stack.back().second;
+                    }
+                    else {
+                        env.emplace(name->get(), stack.back().second);
+                    }
                     stack.pop_back();
                     break;
                 }
@@ -256,6 +285,38 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                     stack.emplace_back(std::make_pair(0, create<List>(args)));
                     break;
                 }
+                case Ops::BUILDDICT: {
+                    // arg is the number of pairs, pushed as key, value, key, value...
+                    DictMap map;
+                    auto pos_iter = stack.end() - 2 * arg;
+                    for (auto iter = pos_iter; iter != stack.end(); iter += 2) {
+                        map.insert(iter->second, (iter + 1)->second);
+                    }
+                    stack.erase(pos_iter, stack.end());
+                    stack.emplace_back(std::make_pair(0, create<Dict>(std::move(map))));
+                    break;
+                }
+                case Ops::FOR_ITER: {
+                    // Steps a native cursor (made from the iterator on first use) and jumps to the loop body with the
+                    // value. Iterators without one, and exhausted cursors, fall through to the __next__ path.
+                    auto& top = stack.back().second;
+                    if (top->obj_type() != NativeIterator::type) {
+                        auto cursor = top->native_iter();
+                        if (!cursor) {
+                            break;
+                        }
+                        top = std::move(cursor);
+                    }
+                    ObjectRef value;
+                    if (static_cast<const NativeIterator*>(top.get())->next(value)) {
+                        stack.emplace_back(std::make_pair(0, std::move(value)));
+                        position = arg;
+                    }
+                    else {
+                        top = NativeIterator::exhausted();
+                    }
+                    break;
+                }
                 case Ops::UNPACK: {
                     auto obj = stack.back().second;
                     stack.pop_back();
@@ -264,24 +325,27 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
                     }
                     auto lst = std::dynamic_pointer_cast<const List>(obj);
                     if ((arg >> 16) == HALF_INT_MAX) {
-                        if (lst->get().size() != (arg & HALF_INT_MAX)) {
+                        if (lst->size() != (arg & HALF_INT_MAX)) {
                             create<ValueError>("Expected sequence of length '" + std::to_string((arg & HALF_INT_MAX))
-                                                + "', got '" + std::to_string(lst->get().size()) + "'")->raise();
+                                                + "', got '" + std::to_string(lst->size()) + "'")->raise();
                         }
                     }
-                    else if (lst->get().size() < (arg & HALF_INT_MAX) - 1) {
+                    else if (lst->size() < (arg & HALF_INT_MAX) - 1) {
                         create<ValueError>("Expected sequence of length '" + std::to_string((arg & HALF_INT_MAX) - 1)
-                                            + "' or greater, got '" + std::to_string(lst->get().size()) + "'")->raise();
+                                            + "' or greater, got '" + std::to_string(lst->size()) + "'")->raise();
                     }
                     auto idx = 0u;
                     for (auto i = 0u; i < (arg & HALF_INT_MAX); ++i) {
                         if (i == (arg >> 16)) {
-                            std::vector<ObjectRef> subseq(lst->get().begin() + idx, lst->get().end() + (arg >> 16) - (arg & HALF_INT_MAX));
+                            std::vector<ObjectRef> subseq;
+                            for (auto end = lst->size() + (arg >> 16) - (arg & HALF_INT_MAX); idx + subseq.size() < end;) {
+                                subseq.push_back(lst->item(idx + subseq.size()));
+                            }
                             stack.emplace_back(std::make_pair(0, create<List>(subseq)));
                             idx += subseq.size();
                         }
                         else {
-                            stack.emplace_back(std::make_pair(0, lst->get()[idx++]));
+                            stack.emplace_back(std::make_pair(0, lst->item(idx++)));
                         }
                     }
                     break;
@@ -304,7 +368,11 @@ std::map<std::string, BaseObjectRef> Frame::execute() const {
 
 TypeRef Module::type = create<Type>("Module", Type::basevec{Object::type});
 
-Module::Module(TypeRef type, std::string name, std::map<std::string, BaseObjectRef> v) : Object(type), name(name), value(v) {
+Module::Module(TypeRef type, std::string name, EnvMap v) : Object(type), name(name), value(std::move(v)) {
+    if (auto iter = value.find("__builtins__"); iter != value.end()) {
+        base_env = std::dynamic_pointer_cast<const BaseEnv>(iter->second);
+        value.erase(iter);
+    }
 }
 
 std::string Module::to_str() const {
@@ -313,15 +381,32 @@ std::string Module::to_str() const {
 
 BaseObjectRef Module::getattr(std::string name) const {
     auto iter = value.find(name);
-    if (iter == value.end()) {
-        return Object::getattr(name);
+    if (iter != value.end()) {
+        return iter->second;
     }
-    return iter->second;
+    if (base_env) {
+        if (auto builtin = base_env->find(name)) {
+            return *builtin;
+        }
+    }
+    return Object::getattr(name);
 }
 
 TypeRef Env::type = create<Type>("Env", Type::basevec{Object::type});
 
-Env::Env(TypeRef type, std::map<std::string, BaseObjectRef> v) : Object(type), value(v) {
+Env::Env(TypeRef type, EnvMap v) : Object(type), value(std::move(v)) {
+}
+
+TypeRef BaseEnv::type = create<Type>("BaseEnv", Type::basevec{Object::type});
+
+BaseEnv::BaseEnv(TypeRef type, const std::map<std::string, BaseObjectRef>& v) : Object(type), value(v.begin(), v.end()) {
+}
+
+const BaseObjectRef* BaseEnv::find(std::string_view name) const {
+    auto iter = std::lower_bound(value.begin(), value.end(), name, [](const auto& item, std::string_view name) {
+        return item.first < name;
+    });
+    return iter != value.end() && iter->first == name ? &iter->second : nullptr;
 }
 
 ExecutionThunk::ExecutionThunk(ExecutionEngine* execengine, std::shared_ptr<const Frame> frame) : Thunk(execengine), frame(frame) {
@@ -329,10 +414,11 @@ ExecutionThunk::ExecutionThunk(ExecutionEngine* execengine, std::shared_ptr<cons
 
 void ExecutionThunk::notify(BaseObjectRef obj) const {
     if (auto thunk = dynamic_cast<const Thunk*>(obj.get())) {
-        std::cerr << "Resubscribe!" << std::endl;
+        TRACE(EXEC, 2, RESUBSCRIBE);
         thunk->subscribe(std::dynamic_pointer_cast<const Thunk>(shared_from_this()));
         return;
     }
+    ExecutingModule executing(execution_engine(), &module());
     auto new_stack = frame->stack_;
     new_stack.push_back(std::make_pair(0, std::dynamic_pointer_cast<const Object>(obj)));
     auto new_frame = create<Frame>(frame->code_, frame->position_, frame->env_, frame->limit_, std::move(new_stack), frame->stack_trace_);
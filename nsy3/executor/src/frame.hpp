@@ -11,40 +11,56 @@
 class Frame : public Object {
     std::shared_ptr<const Code> code_;
     unsigned int position_ = 0, limit_ = -1;
-    std::map<std::string, BaseObjectRef> env_;
+    EnvMap env_;
     std::vector<std::pair<unsigned char, ObjectRef>> stack_;
     std::vector<std::pair<std::string, int>> stack_trace_;
 public:
     Frame(TypeRef type, std::shared_ptr<const Code> code, unsigned int offset,
-          std::map<std::string, BaseObjectRef> env, unsigned int limit=-1, std::vector<std::pair<unsigned char, ObjectRef>> stack={}, std::vector<std::pair<std::string, int>> stack_trace={});
+          EnvMap env, unsigned int limit=-1, std::vector<std::pair<unsigned char, ObjectRef>> stack={}, std::vector<std::pair<std::string, int>> stack_trace={});
     static TypeRef type;
 
-    std::map<std::string, BaseObjectRef> execute() const;
+    EnvMap execute() const;
     bool complete() const;
     std::shared_ptr<const Code> code() const { return code_; }
-    std::map<std::string, BaseObjectRef> env() const { return env_; }
+    EnvMap env() const { return env_; }
 
     static int execution_debug_level;
 
     friend class ExecutionThunk;
 };
 
+class BaseEnv;
+
+// A module's attributes are the names its code set, then the builtins, as they are for the code itself
 class Module : public Object {
     std::string name;
-    std::map<std::string, BaseObjectRef> value;
+    EnvMap value;
+    std::shared_ptr<const BaseEnv> base_env;
 public:
-    Module(TypeRef type, std::string name, std::map<std::string, BaseObjectRef> v);
+    Module(TypeRef type, std::string name, EnvMap v);
     std::string to_str() const override;
     static TypeRef type;
     BaseObjectRef getattr(std::string name) const override;
 };
 
 class Env : public Object {
-    std::map<std::string, BaseObjectRef> value;
+    EnvMap value;
+public:
+    Env(TypeRef type, EnvMap v);
+    static TypeRef type;
+    const EnvMap& get() const { return value; }
+};
+
+// The names every module starts with. A module's env holds it under "__builtins__" and names not in the env are
+// looked up in it, so starting a module or copying an env doesn't copy every builtin.
+class BaseEnv : public Object {
+    // Sorted by name
+    std::vector<std::pair<std::string, BaseObjectRef>> value;
 public:
-    Env(TypeRef type, std::map<std::string, BaseObjectRef> v);
+    BaseEnv(TypeRef type, const std::map<std::string, BaseObjectRef>& v);
     static TypeRef type;
-    const std::map<std::string, BaseObjectRef>& get() const { return value; }
+    // Returns null if name isn't a builtin
+    const BaseObjectRef* find(std::string_view name) const;
 };
 
 class ExecutionThunk : public Thunk {
@@ -33,6 +33,10 @@ bool convert_from_objref<bool>::convert(const ObjectRef& objref) {
 }
 
 std::string convert_from_objref<std::string>::convert(const ObjectRef& objref) {
+    return std::string(convert_from_objref<std::string_view>::convert(objref));
+}
+
+std::string_view convert_from_objref<std::string_view>::convert(const ObjectRef& objref) {
     if (auto obj = dynamic_cast<const String*>(objref.get())) {
         return obj->get();
     }
@@ -41,7 +45,7 @@ std::string convert_from_objref<std::string>::convert(const ObjectRef& objref) {
 
 std::basic_string<unsigned char> convert_from_objref<std::basic_string<unsigned char>>::convert(const ObjectRef& objref) {
     if (auto obj = dynamic_cast<const Bytes*>(objref.get())) {
-        return obj->get();
+        return std::basic_string<unsigned char>(obj->get());
     }
     create<TypeError>("Expected bytes, got " + objref->obj_type()->name())->raise();
 }
@@ -16,6 +16,8 @@ template<> struct convert_from_objref<unsigned int> { static unsigned int conver
 template<> struct convert_from_objref<double> { static double convert(const ObjectRef& objref); };
 template<> struct convert_from_objref<bool> { static bool convert(const ObjectRef& objref); };
 template<> struct convert_from_objref<std::string> { static std::string convert(const ObjectRef& objref); };
+// Views into the String, so only valid while it is
+template<> struct convert_from_objref<std::string_view> { static std::string_view convert(const ObjectRef& objref); };
 template<> struct convert_from_objref<std::basic_string<unsigned char>> { static std::basic_string<unsigned char> convert(const ObjectRef& objref); };
 template<> struct convert_from_objref<ObjectRef> { static ObjectRef convert(const ObjectRef& objref); };
 template<class T> struct convert_from_objref<std::shared_ptr<const T>> {
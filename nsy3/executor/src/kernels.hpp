@@ -0,0 +1,139 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+// Loops over contiguous data, i.e. runs of unboxed list elements and text, written so the compiler vectorises them
+// (see -fopenmp-simd)
+namespace kernels {
+    template<typename T> bool equal(const T* a, const T* b, std::size_t n) {
+        unsigned int differ = 0;
+        #pragma omp simd reduction(|:differ)
+        for (std::size_t i = 0; i < n; ++i) {
+            differ |= a[i] != b[i];
+        }
+        return !differ;
+    }
+
+    template<typename T> bool contains(const T* a, std::size_t n, T value) {
+        unsigned int found = 0;
+        #pragma omp simd reduction(|:found)
+        for (std::size_t i = 0; i < n; ++i) {
+            found |= a[i] == value;
+        }
+        return found;
+    }
+
+    template<typename T> bool all_equal(const T* a, std::size_t n, T value) {
+        unsigned int differ = 0;
+        #pragma omp simd reduction(|:differ)
+        for (std::size_t i = 0; i < n; ++i) {
+            differ |= a[i] != value;
+        }
+        return !differ;
+    }
+
+    // Floating point sums are reassociated, so may differ from a left to right sum in the last bits
+    template<typename R, typename T> R sum(const T* a, std::size_t n) {
+        R total = 0;
+        #pragma omp simd reduction(+:total)
+        for (std::size_t i = 0; i < n; ++i) {
+            total += a[i];
+        }
+        return total;
+    }
+
+    template<typename T> bool has_nan(const T* a, std::size_t n) {
+        unsigned int found = 0;
+        #pragma omp simd reduction(|:found)
+        for (std::size_t i = 0; i < n; ++i) {
+            found |= a[i] != a[i];
+        }
+        return found;
+    }
+
+    // A min or max reduction is reordered, and std::min/std::max only give NaN when it is compared first, so any NaN
+    // is looked for up front and returned
+    template<typename T> T min(const T* a, std::size_t n, T start) {
+        if constexpr (std::is_floating_point_v<T>) {
+            if (start != start || has_nan(a, n)) {
+                return std::numeric_limits<T>::quiet_NaN();
+            }
+        }
+        T res = start;
+        #pragma omp simd reduction(min:res)
+        for (std::size_t i = 0; i < n; ++i) {
+            res = std::min(res, a[i]);
+        }
+        return res;
+    }
+
+    template<typename T> T max(const T* a, std::size_t n, T start) {
+        if constexpr (std::is_floating_point_v<T>) {
+            if (start != start || has_nan(a, n)) {
+                return std::numeric_limits<T>::quiet_NaN();
+            }
+        }
+        T res = start;
+        #pragma omp simd reduction(max:res)
+        for (std::size_t i = 0; i < n; ++i) {
+            res = std::max(res, a[i]);
+        }
+        return res;
+    }
+
+    template<typename T, typename Op> void elementwise(const T* a, const T* b, T* out, std::size_t n, Op op) {
+        #pragma omp simd
+        for (std::size_t i = 0; i < n; ++i) {
+            out[i] = op(a[i], b[i]);
+        }
+    }
+
+    template<typename T, typename Op> void elementwise(const T* a, T b, T* out, std::size_t n, Op op) {
+        #pragma omp simd
+        for (std::size_t i = 0; i < n; ++i) {
+            out[i] = op(a[i], b);
+        }
+    }
+
+    // The position of needle in text at or after pos, or npos. Candidates are found with memchr, which libc
+    // vectorises, on the needle's first character, and only those are compared in full.
+    template<typename CharT>
+    std::size_t find(std::basic_string_view<CharT> text, std::basic_string_view<CharT> needle, std::size_t pos = 0) {
+        static_assert(sizeof(CharT) == 1);
+        if (needle.empty()) {
+            return pos <= text.size() ? pos : text.npos;
+        }
+        if (pos >= text.size() || needle.size() > text.size() - pos) {
+            return text.npos;
+        }
+        auto begin = text.data(), last = text.data() + text.size() - needle.size();
+        for (auto at = begin + pos; at <= last; ++at) {
+            at = static_cast<const CharT*>(std::memchr(at, needle[0], last - at + 1));
+            if (!at) {
+                break;
+            }
+            if (std::memcmp(at + 1, needle.data() + 1, needle.size() - 1) == 0) {
+                return at - begin;
+            }
+        }
+        return text.npos;
+    }
+
+    // Changes the case of ASCII letters, leaving every other byte alone
+    template<typename CharT> void ascii_case(const CharT* in, CharT* out, std::size_t n, bool upper) {
+        const unsigned char first = upper ? 'a' : 'A';
+        #pragma omp simd
+        for (std::size_t i = 0; i < n; ++i) {
+            unsigned char c = in[i];
+            out[i] = static_cast<unsigned char>(c - first) < 26 ? c ^ 0x20 : c;
+        }
+    }
+}
+
+#endif // KERNELS_HPP
@@ -6,7 +6,10 @@
 #include "executionengine.hpp"
 #include "exception.hpp"
 #include "serialisation.hpp"
+#include "resultstore.hpp"
+#include "bundle.hpp"
 #include "frame.hpp"
+#include "trace.hpp"
 
 #ifdef COVERAGE
     extern "C" {
@@ -18,28 +21,111 @@ static const char USAGE[] =
 R"(fs
 
     Usage:
-        executor runspec <rsfile> [--nocatch] [--debug]
+        executor runspec <rsfile> [--stream=<file>] [--store=<file>] [--nocatch] [--debug] [--disassemble] [--trace=<spec>]
+        executor runbundle <bundlefile> [--stream=<file>] [--store=<file>] [--nocatch] [--debug] [--disassemble] [--trace=<spec>]
+        executor matrix <rsfile> [--jobs=<n>] [--nocatch] [--debug] [--disassemble] [--trace=<spec>]
+        executor watch <rsfile> [--interval=<ms>] [--nocatch] [--debug] [--disassemble] [--trace=<spec>]
         executor run <files>...
+        executor lookup <storefile> <names>...
 
     Options:
         -h --help                        Show this screen.
         --version                        Show version.
+        --trace=<spec>                   Set trace levels, as a level or category:level list, and print the trace at the end.
 )";
 
+// How much of the trace leads up to an error message
+static const std::size_t ERROR_TRACE_RECORDS = 100;
 
 int main(int argc, const char** argv) {
     auto args = docopt::docopt(USAGE, {argv + 1, argv + argc}, true, "executor 0.1");
+    if (args["lookup"].asBool()) {
+        int status = 0;
+        try {
+            ResultStore store(args["<storefile>"].asString());
+            for (auto& name : args["<names>"].asStringList()) {
+                if (auto value = store.lookup(name)) {
+                    std::cout << name << " = " << value << std::endl;
+                }
+                else {
+                    std::cerr << name << " not found" << std::endl;
+                    status = 1;
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return status;
+    }
     ObjectRef runspec;
+    std::shared_ptr<const Bundle> bundle;
     if (args["--debug"].asBool()) {
         Frame::execution_debug_level = 1;
     }
-    if (args["runspec"].asBool()) {
-        if (args["<rsfile>"].asString() == "-") {
-            runspec = deserialise_from_file(std::cin);
+    if (args["--trace"]) {
+        try {
+            trace::configure(args["--trace"].asString());
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Invalid trace levels: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    unsigned int jobs = 1;
+    if (args["--jobs"]) {
+        int value = 0;
+        try {
+            value = std::stoi(args["--jobs"].asString());
+        }
+        catch (const std::exception&) {
+        }
+        if (value < 1) {
+            std::cerr << "Invalid job count: " << args["--jobs"].asString() << ", must be at least 1" << std::endl;
+            std::cerr << USAGE;
+            return 1;
+        }
+        jobs = value;
+    }
+    unsigned int interval = 500;
+    if (args["--interval"]) {
+        int value = 0;
+        try {
+            value = std::stoi(args["--interval"].asString());
+        }
+        catch (const std::exception&) {
+        }
+        if (value < 1) {
+            std::cerr << "Invalid interval: " << args["--interval"].asString() << ", must be at least 1" << std::endl;
+            std::cerr << USAGE;
+            return 1;
+        }
+        interval = value;
+    }
+    if (args["runspec"].asBool() || args["matrix"].asBool() || args["watch"].asBool()) {
+        try {
+            if (args["<rsfile>"].asString() == "-") {
+                runspec = deserialise_from_file(std::cin);
+            }
+            else {
+                std::ifstream f(args["<rsfile>"].asString());
+                runspec = deserialise_from_file(f);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Could not read runspec: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else if (args["runbundle"].asBool()) {
+        try {
+            bundle = std::make_shared<const Bundle>(args["<bundlefile>"].asString());
+            runspec = bundle->runspec();
         }
-        else {
-            std::ifstream f(args["<rsfile>"].asString());
-            runspec = deserialise_from_file(f);
+        catch (const std::exception& e) {
+            std::cerr << "Could not read bundle: " << e.what() << std::endl;
+            return 1;
         }
     }
     else {
@@ -50,33 +136,68 @@ int main(int argc, const char** argv) {
 //         runspec[create<String>("files"] = files;
     }
     auto execengine = ExecutionEngine();
-
-    if (args["--nocatch"].asBool()) {
+    execengine.set_disassemble(args["--disassemble"].asBool());
+    if (bundle) {
+        execengine.set_code_loader([bundle](const std::string& fname, ConstInterner* interner) {
+            return bundle->load(fname, interner);
+        });
+    }
+    std::ofstream stream;
+    if (args["--stream"]) {
+        stream.open(args["--stream"].asString(), std::ios::binary);
+        if (!stream) {
+            std::cerr << "Could not open " << args["--stream"].asString() << std::endl;
+            return 1;
+        }
+        execengine.set_stream(&stream);
+    }
+    if (args["--store"]) {
+        execengine.set_store(args["--store"].asString());
+    }
+    auto run = [&]() {
+        if (args["watch"].asBool()) {
+            execengine.watch(runspec, interval);
+            return 0;
+        }
         execengine.exec_runspec(runspec);
+        if (args["matrix"].asBool()) {
+            return execengine.finish_variants(runspec, jobs) ? 1 : 0;
+        }
         execengine.finish();
+        return 0;
+    };
+    int status = 0;
+
+    if (args["--nocatch"].asBool()) {
+        status = run();
     }
     else {
         try {
-            execengine.exec_runspec(runspec);
-            execengine.finish();
+            status = run();
         }
         catch (const ExceptionContainer& exc) {
+            trace::dump(std::cerr, ERROR_TRACE_RECORDS);
             std::cerr << exc.exception->to_str() << std::endl;
             return 1;
         }
         catch (const std::exception& e) {
+            trace::dump(std::cerr, ERROR_TRACE_RECORDS);
             std::cerr << e.what() << std::endl;
             return 1;
         }
         catch (...) {
+            trace::dump(std::cerr, ERROR_TRACE_RECORDS);
             std::cerr << "Unknown exception" << std::endl;
             return 1;
         }
     }
+    if (args["--trace"]) {
+        trace::dump(std::cerr);
+    }
 
 #ifdef COVERAGE
     __gcov_flush();
 #endif
 
-    return 0;
+    return status;
 }
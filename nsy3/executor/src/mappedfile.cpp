@@ -0,0 +1,35 @@
+#include "mappedfile.hpp"
+
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFile::MappedFile(const std::string& fname) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + fname);
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        throw std::runtime_error("Could not stat " + fname);
+    }
+    size_ = st.st_size;
+    if (size_) {
+        auto ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Could not map " + fname);
+        }
+        data_ = static_cast<const char*>(ptr);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
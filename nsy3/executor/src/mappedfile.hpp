@@ -0,0 +1,22 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <string_view>
+
+// A read only memory mapping of a whole file, unmapped when destroyed
+class MappedFile {
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+public:
+    MappedFile(const std::string& fname);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    std::string_view view() const { return {data_, size_}; }
+};
+
+#endif // MAPPEDFILE_HPP
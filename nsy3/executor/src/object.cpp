@@ -6,7 +6,11 @@
 #include <sstream>
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <type_traits>
 #include "executionengine.hpp"
+#include "kernels.hpp"
+#include "textmethods.hpp"
 
 std::ostream& operator<<(std::ostream& s, const ObjectRef& obj) {
     if (!obj) {
@@ -36,7 +40,7 @@ std::string Object::to_str() const {
     return type_->name() + "(?)";
 }
 
-TypeRef Object::obj_type() const {
+const TypeRef& Object::obj_type() const {
     return type_;
 }
 
@@ -50,19 +54,14 @@ BaseObjectRef Object::getattr(std::string name) const {
 
 ObjectRef Object::gettype(std::string name) const {
     ObjectRef obj;
-    {
-        auto iter = type_->attrs().find(name);
-        if (iter != type_->attrs().end()) {
-            obj = iter->second;
-        }
-        else {
-            auto& mro = type_->mro();
-            for (auto iter = mro.begin(); iter != mro.end(); ++iter) {
-                auto titer = (*iter)->attrs().find(name);
-                if (titer != (*iter)->attrs().end()) {
-                    obj = titer->second;
-                    break;
-                }
+    if (auto attr = type_->find_attr(name)) {
+        obj = *attr;
+    }
+    else {
+        for (auto& type : type_->mro()) {
+            if (auto attr = type->find_attr(name)) {
+                obj = *attr;
+                break;
             }
         }
     }
@@ -80,9 +79,8 @@ ObjectRef Object::getsuper(TypeRef type, std::string name) const {
     ObjectRef obj;
 
     for (auto iter = type == type_ ? mro.begin() : std::find(mro.begin(), mro.end(), type); iter != mro.end(); ++iter) {
-        auto titer = (*iter)->attrs().find(name);
-        if (titer != (*iter)->attrs().end()) {
-            obj = titer->second;
+        if (auto attr = (*iter)->find_attr(name)) {
+            obj = *attr;
             break;
         }
     }
@@ -103,6 +101,10 @@ ObjectRef Object::call_no_thunks(const std::vector<ObjectRef>& args) const {
     return no_thunks(call(args));
 }
 
+std::shared_ptr<const NativeIterator> Object::native_iter() const {
+    return nullptr;
+}
+
 
 std::size_t Object::hash() const {
     create<TypeError>("Type '" + type_->name() + "' is not hashable")->raise();
@@ -146,6 +148,8 @@ std::vector<TypeRef> make_top_types() {
 
     Type::attrmap obj_attrs = {
         {"<=>", unsupported_op("<=>")},
+        // Containers provide rin for membership, which 'a in b' calls on b
+        {"rin", unsupported_op("in")},
         {"==", create<BuiltinFunction>([](ObjectRef a, ObjectRef b) {
             try {
                 return convert<int>(a->gettype("<=>")->call_no_thunks({b})) == 0;
@@ -211,7 +215,7 @@ std::vector<TypeRef> make_top_types() {
         {"**", unsupported_op("**")},
         {"r**", unsupported_op("r**")},
         {"[]", unsupported_op("[]")},
-        {"__type__", create<Property>(create<BuiltinFunction>(method(&Object::obj_type)))},
+        {"__type__", create<Property>(create<BuiltinFunction>([](const Object* self) { return self->obj_type(); }))},
         {"to_str", create<BuiltinFunction>(method(&Object::to_str))}
     };
 
@@ -229,6 +233,12 @@ TypeRef Property::type;
 static auto top_types = make_top_types();
 
 std::vector<TypeRef> Type::make_mro(const std::vector<TypeRef>& bases) {
+    // With a single base, which is every builtin type, C3 reduces to the base followed by its MRO
+    if (bases.size() == 1) {
+        std::vector<TypeRef> mro = {bases.front()};
+        mro.insert(mro.end(), bases.front()->mro_.begin(), bases.front()->mro_.end());
+        return mro;
+    }
     // C3 superclass linearization algorithm
     std::vector<TypeRef> mro;
     std::vector<std::vector<TypeRef>> base_bases;
@@ -271,7 +281,14 @@ std::vector<TypeRef> Type::make_mro(const std::vector<TypeRef>& bases) {
 }
 
 Type::Type(TypeRef type, std::string name, std::vector<TypeRef> bases, std::map<std::string, ObjectRef> attrs)
-    : Object(type), name_(name), bases_(bases), mro_(make_mro(bases)), attrs_(attrs) {
+    : Object(type), name_(name), bases_(bases), mro_(make_mro(bases)), attrs_(std::make_move_iterator(attrs.begin()), std::make_move_iterator(attrs.end())) {
+}
+
+const ObjectRef* Type::find_attr(std::string_view name) const {
+    auto iter = std::lower_bound(attrs_.begin(), attrs_.end(), name, [](const auto& attr, std::string_view name) {
+        return attr.first < name;
+    });
+    return iter != attrs_.end() && iter->first == name ? &iter->second : nullptr;
 }
 
 std::string Type::to_str() const {
@@ -279,11 +296,10 @@ std::string Type::to_str() const {
 }
 
 BaseObjectRef Type::getattr(std::string name) const {
-    auto iter = attrs_.find(name);
-    if (iter == attrs_.end()) {
-        return Object::getattr(name);
+    if (auto attr = find_attr(name)) {
+        return *attr;
     }
-    return iter->second;
+    return Object::getattr(name);
 }
 
 BaseObjectRef Type::call(const std::vector<ObjectRef>& args) const {
@@ -365,6 +381,20 @@ TypeRef Integer::type = create<Type>("Integer", Type::basevec{Numeric::type}, Ty
 Integer::Integer(TypeRef type, int64_t v) : Numeric(type), value(v) {
 }
 
+namespace {
+    // Spreads nearby integers over all the bits, since tables use the low bits of the hash
+    std::size_t hash_int(int64_t value) {
+        uint64_t x = value;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+}
+
+std::size_t Integer::hash() const {
+    return hash_int(value);
+}
+
 std::string Integer::to_str() const {
     return std::to_string(value);
 }
@@ -483,54 +513,107 @@ bool Float::to_bool() const {
     return value;
 }
 
-TypeRef String::type = create<Type>("String", Type::basevec{Object::type}, Type::attrmap{
+std::size_t Float::hash() const {
+    // Floats equal to an integer must hash like it
+    if (value == std::trunc(value) && std::abs(value) < 9.2e18) {
+        return hash_int(static_cast<int64_t>(value));
+    }
+    return std::hash<double>{}(value);
+}
+
+namespace {
+    // Like Python's slices, negative bounds count from the end, and bounds still out of range are clamped
+    template<typename CharT> Rope<CharT> slice(const Rope<CharT>& rope, int64_t start, int64_t stop) {
+        int64_t size = rope.size();
+        start = std::clamp<int64_t>(start < 0 ? start + size : start, 0, size);
+        stop = std::clamp<int64_t>(stop < 0 ? stop + size : stop, start, size);
+        return rope.substr(start, stop - start);
+    }
+
+    template<typename CharT> void check_index(const Rope<CharT>& rope, const Integer* idx) {
+        if (idx->get() < 0 || idx->get() >= static_cast<int64_t>(rope.size())) {
+            create<IndexError>("Index " + idx->to_str() + " is out of bounds for string of size " + std::to_string(rope.size()))->raise();
+        }
+    }
+
+    std::size_t hash_bytes(std::basic_string_view<unsigned char> v) {
+        return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(v.data()), v.size()));
+    }
+}
+
+TypeRef String::type = create<Type>("String", Type::basevec{Object::type}, with_text_methods<String>(Type::attrmap{
     {"+", create<BuiltinFunction>([](const String* self, ObjectRef other) -> BaseObjectRef {
         if (auto other_s = dynamic_cast<const String*>(other.get())) {
-            return create<String>(self->value + other_s->value);
+            return create<String>(self->value.concat(other_s->value));
         }
         return self->getsuper(String::type, "+")->call({other});
     })},
     {"*", create<BuiltinFunction>([](const String* self, ObjectRef other) -> BaseObjectRef {
         if (auto other_i = dynamic_cast<const Integer*>(other.get())) {
-            std::string res(self->value.size() * std::max(0l, other_i->get()), '\0');
+            auto value = self->get();
+            std::string res(value.size() * std::max(0l, other_i->get()), '\0');
             for (auto i = other_i->get(); i > 0;) {
-                res.replace(--i * self->value.size(), self->value.size(), self->value);
+                res.replace(--i * value.size(), value.size(), value);
             }
             return create<String>(res);
         }
         return self->getsuper(String::type, "*")->call({other});
     })},
     {"==", create<BuiltinFunction>([](const String* self, ObjectRef other) -> BaseObjectRef {
+        if (other.get() == self) {
+            return Boolean::true_;
+        }
         if (auto other_s = dynamic_cast<const String*>(other.get())) {
             return create<Boolean>(self->get() == other_s->get());
         }
         return self->getsuper(String::type, "==")->call({other});
     })},
-});
+    // Indexing and slicing share the string's buffer
+    {"[]", create<BuiltinFunction>([](const String* self, const Integer* idx) {
+        check_index(self->value, idx);
+        return create<String>(self->value.substr(idx->get(), 1));
+    })},
+    {"slice", create<BuiltinFunction>([](const String* self, const Integer* start, const Integer* stop) {
+        return create<String>(slice(self->value, start->get(), stop->get()));
+    })},
+}));
 
-String::String(TypeRef type, std::string v) : Object(type), value(v) {
+String::String(TypeRef type, std::string v) : Object(type), value(std::move(v)) {
+}
+
+String::String(TypeRef type, std::shared_ptr<const void> owner, std::string_view v) : Object(type), value(std::move(owner), v) {
+}
+
+String::String(TypeRef type, Rope<char> v) : Object(type), value(std::move(v)) {
 }
 
 std::string String::to_str() const {
-    return value;
+    return std::string(get());
 }
 
 std::size_t String::hash() const {
-    return std::hash<std::string>{}(value);
+    // 0 means not computed yet, so a hash that really is 0 is just recomputed each time
+    auto hash = hash_.load(std::memory_order_relaxed);
+    if (!hash) {
+        hash = std::hash<std::string_view>{}(get());
+        hash_.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
 }
 
-TypeRef Bytes::type = create<Type>("Bytes", Type::basevec{Object::type}, Type::attrmap{
+TypeRef Bytes::type = create<Type>("Bytes", Type::basevec{Object::type}, with_text_methods<Bytes>(Type::attrmap{
     {"+", create<BuiltinFunction>([](const Bytes* self, ObjectRef other) -> BaseObjectRef {
         if (auto other_s = dynamic_cast<const Bytes*>(other.get())) {
-            return create<Bytes>(self->value + other_s->value);
+            return create<Bytes>(self->value.concat(other_s->value));
         }
         return self->getsuper(Bytes::type, "+")->call({other});
     })},
     {"*", create<BuiltinFunction>([](const Bytes* self, ObjectRef other) -> BaseObjectRef {
         if (auto other_i = dynamic_cast<const Integer*>(other.get())) {
-            std::basic_string<unsigned char> res(self->value.size() * std::max(0l, other_i->get()), '\0');
-            for (auto i = other_i->get(); i;) {
-                res.replace(--i * self->value.size(), self->value.size(), self->value);
+            auto value = self->get();
+            std::basic_string<unsigned char> res(value.size() * std::max(0l, other_i->get()), '\0');
+            for (auto i = other_i->get(); i > 0;) {
+                res.replace(--i * value.size(), value.size(), value);
             }
             return create<Bytes>(res);
         }
@@ -542,15 +625,37 @@ TypeRef Bytes::type = create<Type>("Bytes", Type::basevec{Object::type}, Type::a
         }
         return self->getsuper(Bytes::type, "==")->call({other});
     })},
-});
+    {"[]", create<BuiltinFunction>([](const Bytes* self, const Integer* idx) {
+        check_index(self->value, idx);
+        return create<Integer>(self->get()[idx->get()]);
+    })},
+    {"slice", create<BuiltinFunction>([](const Bytes* self, const Integer* start, const Integer* stop) {
+        return create<Bytes>(slice(self->value, start->get(), stop->get()));
+    })},
+}));
+
+Bytes::Bytes(TypeRef type, std::basic_string<unsigned char> v) : Object(type), value(std::move(v)) {
+}
 
-Bytes::Bytes(TypeRef type, std::basic_string<unsigned char> v) : Object(type), value(v) {
+Bytes::Bytes(TypeRef type, std::shared_ptr<const void> owner, std::basic_string_view<unsigned char> v) : Object(type), value(std::move(owner), v) {
+}
+
+Bytes::Bytes(TypeRef type, Rope<unsigned char> v) : Object(type), value(std::move(v)) {
 }
 
 std::string Bytes::to_str() const {
     return "Bytes";
 }
 
+std::size_t Bytes::hash() const {
+    auto hash = hash_.load(std::memory_order_relaxed);
+    if (!hash) {
+        hash = hash_bytes(get());
+        hash_.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
 TypeRef NoneType::type = create<Type>("NoneType", Type::basevec{Object::type});
 std::shared_ptr<const NoneType> NoneType::none = std::shared_ptr<NoneType>(new NoneType(NoneType::type));
 
@@ -565,6 +670,10 @@ bool NoneType::to_bool() const {
     return false;
 }
 
+std::size_t NoneType::hash() const {
+    return 0;
+}
+
 
 TypeRef BoundMethod::type = create<Type>("BoundMethod", Type::basevec{Object::type});
 
@@ -593,16 +702,71 @@ BaseObjectRef Property::call(const std::vector<ObjectRef>& args) const {
 }
 
 TypeRef Dict::type = create<Type>("Dict", Type::basevec{Object::type}, Type::attrmap{
+    {"__new__", create<BuiltinFunction>([](const std::vector<ObjectRef>& args) {
+        if (args.size() > 1) {
+            create<TypeError>("Dict takes at most one argument")->raise();
+        }
+        DictMap map;
+        if (args.size()) {
+            for (auto& item : convert<const List*>(args[0])->get()) {
+                auto pair = dynamic_cast<const List*>(item.get());
+                if (!pair || pair->get().size() != 2) {
+                    create<TypeError>("Dict items must be [key, value] pairs")->raise();
+                }
+                map.insert(pair->get()[0], pair->get()[1]);
+            }
+        }
+        return create<Dict>(std::move(map));
+    })},
     {"[]", create<BuiltinFunction>([](const Dict* self, ObjectRef key) {
-        auto iter = self->value.find(key);
-        if (iter == self->value.end()) {
+        auto value = self->value.lookup(key);
+        if (!value) {
             create<IndexError>("No such key " + key->to_str())->raise();
         }
-        return iter->second;
-    })}
+        return *value;
+    })},
+    {"==", create<BuiltinFunction>([](const Dict* self, ObjectRef other) -> BaseObjectRef {
+        if (auto other_d = dynamic_cast<const Dict*>(other.get())) {
+            if (self->value.size() != other_d->value.size()) {
+                return Boolean::false_;
+            }
+            for (auto& item : self->value) {
+                auto value = other_d->value.lookup(item.first);
+                if (!value || !item.second->eq(*value)) {
+                    return Boolean::false_;
+                }
+            }
+            return Boolean::true_;
+        }
+        return self->getsuper(Dict::type, "==")->call({other});
+    })},
+    {"__iter__", create<BuiltinFunction>([](std::shared_ptr<const Dict> self) -> ObjectRef {
+        return create<DictIterator>(self, self->value.begin());
+    })},
+    {"rin", create<BuiltinFunction>([](const Dict* self, ObjectRef key) -> BaseObjectRef {
+        return self->value.contains(key) ? Boolean::true_ : Boolean::false_;
+    })},
+    {"set", create<BuiltinFunction>([](const Dict* self, ObjectRef key, ObjectRef value) {
+        return create<Dict>(self->value.set(key, value));
+    })},
+    {"remove", create<BuiltinFunction>([](const Dict* self, ObjectRef key) {
+        return create<Dict>(self->value.remove(key));
+    })},
+    {"merge", create<BuiltinFunction>([](const Dict* self, const Dict* other) {
+        return create<Dict>(self->value.merge(other->value));
+    })},
 });
 
-Dict::Dict(TypeRef type, ObjectRefMap v) : Object(type), value(v) {
+Dict::Dict(TypeRef type, const ObjectRefMap& v) : Object(type), value(v.begin(), v.end()) {
+}
+
+Dict::Dict(TypeRef type, DictMap v) : Object(type), value(std::move(v)) {
+}
+
+Dict::~Dict() {
+    std::vector<ObjectRef> pending;
+    value.release(pending);
+    release_nested(std::move(pending));
 }
 
 std::string Dict::to_str() const {
@@ -620,23 +784,391 @@ std::string Dict::to_str() const {
     return ss.str();
 }
 
+namespace {
+    // Builds from a List or another Set
+    SetMap set_items(const ObjectRef& obj) {
+        if (auto set = dynamic_cast<const Set*>(obj.get())) {
+            return set->get();
+        }
+        SetMap items;
+        for (auto& item : convert<const List*>(obj)->get()) {
+            items.insert(item, {});
+        }
+        return items;
+    }
+}
+
+TypeRef Set::type = create<Type>("Set", Type::basevec{Object::type}, Type::attrmap{
+    {"__new__", create<BuiltinFunction>([](const std::vector<ObjectRef>& args) {
+        if (args.size() > 1) {
+            create<TypeError>("Set takes at most one argument")->raise();
+        }
+        return create<Set>(args.size() ? set_items(args[0]) : SetMap{});
+    })},
+    {"rin", create<BuiltinFunction>([](const Set* self, ObjectRef obj) -> BaseObjectRef {
+        return self->value.contains(obj) ? Boolean::true_ : Boolean::false_;
+    })},
+    {"__iter__", create<BuiltinFunction>([](std::shared_ptr<const Set> self) -> ObjectRef {
+        return create<SetIterator>(self, self->value.begin());
+    })},
+    {"==", create<BuiltinFunction>([](const Set* self, ObjectRef other) -> BaseObjectRef {
+        if (auto other_s = dynamic_cast<const Set*>(other.get())) {
+            if (self->value.size() != other_s->value.size()) {
+                return Boolean::false_;
+            }
+            for (auto& item : self->value) {
+                if (!other_s->value.contains(item.first)) {
+                    return Boolean::false_;
+                }
+            }
+            return Boolean::true_;
+        }
+        return self->getsuper(Set::type, "==")->call({other});
+    })},
+    {"add", create<BuiltinFunction>([](const Set* self, ObjectRef obj) {
+        return create<Set>(self->value.set(obj, {}));
+    })},
+    {"remove", create<BuiltinFunction>([](const Set* self, ObjectRef obj) {
+        return create<Set>(self->value.remove(obj));
+    })},
+    // The results share structure with the larger operand where they can
+    {"union", create<BuiltinFunction>([](const Set* self, ObjectRef other) {
+        auto other_items = set_items(other);
+        auto& larger = self->value.size() >= other_items.size() ? self->value : other_items;
+        auto& smaller = self->value.size() >= other_items.size() ? other_items : self->value;
+        auto res = larger;
+        for (auto& item : smaller) {
+            res.insert(item.first, {});
+        }
+        return create<Set>(std::move(res));
+    })},
+    {"intersection", create<BuiltinFunction>([](const Set* self, ObjectRef other) {
+        auto other_items = set_items(other);
+        auto& larger = self->value.size() >= other_items.size() ? self->value : other_items;
+        auto& smaller = self->value.size() >= other_items.size() ? other_items : self->value;
+        SetMap res;
+        for (auto& item : smaller) {
+            if (larger.contains(item.first)) {
+                res.insert(item.first, {});
+            }
+        }
+        return create<Set>(std::move(res));
+    })},
+    {"difference", create<BuiltinFunction>([](const Set* self, ObjectRef other) {
+        auto other_items = set_items(other);
+        if (other_items.size() < self->value.size()) {
+            auto res = self->value;
+            for (auto& item : other_items) {
+                res = res.remove(item.first);
+            }
+            return create<Set>(std::move(res));
+        }
+        SetMap res;
+        for (auto& item : self->value) {
+            if (!other_items.contains(item.first)) {
+                res.insert(item.first, {});
+            }
+        }
+        return create<Set>(std::move(res));
+    })},
+});
+
+Set::Set(TypeRef type, SetMap v) : Object(type), value(std::move(v)) {
+}
+
+Set::~Set() {
+    std::vector<ObjectRef> pending;
+    value.release(pending);
+    release_nested(std::move(pending));
+}
+
+std::string Set::to_str() const {
+    std::stringstream ss;
+    ss << "{";
+    bool first = true;
+    for (auto& item : value) {
+        if (!first) {
+            ss << ", ";
+        }
+        ss << item.first;
+        first = false;
+    }
+    ss << "}";
+    return ss.str();
+}
+
+TypeRef SetIterator::type = create<Type>("SetIterator", Type::basevec{Object::type}, Type::attrmap{
+    {"__iter__", create<BuiltinFunction>([](ObjectRef self) -> ObjectRef {
+        return self;
+    })},
+    // The rest of the set is copied into a list once and the later steps go through that, as stepping the trie
+    // position would copy its path every time
+    {"__next__", create<BuiltinFunction>([](const SetIterator* self) -> ObjectRef {
+        std::vector<ObjectRef> rest;
+        for (auto iter = self->position; iter != self->set->get().end(); ++iter) {
+            rest.push_back(iter->first);
+        }
+        if (rest.empty()) {
+            return NoneType::none;
+        }
+        auto first = rest.front();
+        return create<List>(std::vector<ObjectRef>{create<ListIterator>(create<List>(std::move(rest)), 1), first});
+    })}
+});
+
+SetIterator::SetIterator(TypeRef type, std::shared_ptr<const Set> set, SetMap::const_iterator position) : Object(type), set(set), position(position) {
+}
+
+TypeRef DictIterator::type = create<Type>("DictIterator", Type::basevec{Object::type}, Type::attrmap{
+    {"__iter__", create<BuiltinFunction>([](ObjectRef self) -> ObjectRef {
+        return self;
+    })},
+    {"__next__", create<BuiltinFunction>([](const DictIterator* self) -> ObjectRef {
+        if (self->position == self->dict->get().end()) {
+            return NoneType::none;
+        }
+        auto next = self->position;
+        ++next;
+        return create<List>(std::vector<ObjectRef>{create<DictIterator>(self->dict, next), self->position->first});
+    })}
+});
+
+DictIterator::DictIterator(TypeRef type, std::shared_ptr<const Dict> dict, DictMap::const_iterator position) : Object(type), dict(dict), position(position) {
+}
+
+namespace {
+    // The alternative of List::Storage that holds obj unboxed, or 0 if it has to stay boxed
+    std::size_t storage_index(const Object& obj) {
+        auto type = obj.obj_type().get();
+        if (type == Integer::type.get()) {
+            return 1;
+        }
+        if (type == Float::type.get()) {
+            return 2;
+        }
+        if (type == Boolean::type.get()) {
+            return 3;
+        }
+        return 0;
+    }
+
+    template<typename T> T unbox(const Object& obj);
+    template<> int64_t unbox(const Object& obj) { return static_cast<const Integer&>(obj).get(); }
+    template<> double unbox(const Object& obj) { return static_cast<const Float&>(obj).get(); }
+    template<> uint8_t unbox(const Object& obj) { return static_cast<const Integer&>(obj).get(); }
+
+    ObjectRef box(const ObjectRef& obj) { return obj; }
+    ObjectRef box(int64_t value) { return create<Integer>(value); }
+    ObjectRef box(double value) { return create<Float>(value); }
+    ObjectRef box(uint8_t value) { return value ? Boolean::true_ : Boolean::false_; }
+
+    template<typename T> PVector<T> unbox_all(const std::vector<ObjectRef>& items) {
+        std::vector<T> values;
+        values.reserve(items.size());
+        for (auto& item : items) {
+            values.push_back(unbox<T>(*item));
+        }
+        return PVector<T>(std::move(values));
+    }
+
+    List::Storage pack(std::vector<ObjectRef> items) {
+        auto index = items.empty() ? 0 : storage_index(*items.front());
+        for (auto iter = items.begin(); index && iter != items.end(); ++iter) {
+            if (storage_index(**iter) != index) {
+                index = 0;
+            }
+        }
+        switch (index) {
+            case 1: return unbox_all<int64_t>(items);
+            case 2: return unbox_all<double>(items);
+            case 3: return unbox_all<uint8_t>(items);
+        }
+        return PVector<ObjectRef>(std::move(items));
+    }
+
+    template<typename T> PVector<T> append_unboxed(const List::Storage& storage, const Object& obj) {
+        auto values = std::get_if<PVector<T>>(&storage);
+        return (values ? *values : PVector<T>()).push_back(unbox<T>(obj));
+    }
+
+    template<typename T> bool typed_equal(const PVector<T>& a, const PVector<T>& b) {
+        for (std::size_t i = 0; i < a.size(); i += PVector<T>::CHUNK) {
+            if (!kernels::equal(a.chunk(i), b.chunk(i), std::min(PVector<T>::CHUNK, a.size() - i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename T> ObjectRef typed_sum(const PVector<T>& values) {
+        // Booleans are summed as integers
+        using R = std::conditional_t<std::is_same_v<T, double>, double, int64_t>;
+        R total = 0;
+        values.for_each_chunk([&](const T* data, std::size_t count) {
+            total += kernels::sum<R>(data, count);
+        });
+        return box(total);
+    }
+
+    template<bool Max, typename T> ObjectRef typed_extreme(const PVector<T>& values) {
+        T res = values[0];
+        values.for_each_chunk([&](const T* data, std::size_t count) {
+            res = Max ? kernels::max(data, count, res) : kernels::min(data, count, res);
+        });
+        return box(res);
+    }
+
+    template<bool Max> ObjectRef extreme(const List* self) {
+        if (!self->size()) {
+            create<ValueError>(std::string(Max ? "max" : "min") + " of an empty list")->raise();
+        }
+        if (auto objects = std::get_if<PVector<ObjectRef>>(&self->storage())) {
+            auto res = (*objects)[0];
+            for (auto& item : *objects) {
+                if (convert<bool>(item->gettype(Max ? ">" : "<")->call_no_thunks({res}))) {
+                    res = item;
+                }
+            }
+            return res;
+        }
+        return std::visit([](auto& values) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(values)>, PVector<ObjectRef>>) {
+                return ObjectRef();
+            }
+            else {
+                return typed_extreme<Max>(values);
+            }
+        }, self->storage());
+    }
+
+    // The numbers in a list, or a single number standing in for all of them. Integers (and booleans) stay integers
+    // unless a float is involved.
+    struct NumericOperand {
+        bool is_list = false, is_float = false;
+        PVector<int64_t> ints;
+        PVector<double> floats;
+        int64_t int_value = 0;
+        double float_value = 0;
+
+        explicit NumericOperand(const ObjectRef& obj) {
+            if (auto list = dynamic_cast<const List*>(obj.get())) {
+                is_list = true;
+                auto& storage = list->storage();
+                if (auto values = std::get_if<PVector<int64_t>>(&storage)) {
+                    ints = *values;
+                }
+                else if (auto values = std::get_if<PVector<double>>(&storage)) {
+                    floats = *values;
+                    is_float = true;
+                }
+                else if (auto values = std::get_if<PVector<uint8_t>>(&storage)) {
+                    ints = PVector<int64_t>(std::vector<int64_t>(values->begin(), values->end()));
+                }
+                else {
+                    std::vector<int64_t> int_values;
+                    std::vector<double> float_values;
+                    for (auto& item : list->get()) {
+                        auto num = dynamic_cast<const Numeric*>(item.get());
+                        if (!num) {
+                            create<TypeError>("Expected a list of numbers, got a " + item->obj_type()->name() + " in it")->raise();
+                        }
+                        auto integer = dynamic_cast<const Integer*>(num);
+                        is_float = is_float || !integer;
+                        int_values.push_back(integer ? integer->get() : 0);
+                        float_values.push_back(num->to_double());
+                    }
+                    if (is_float) {
+                        floats = PVector<double>(std::move(float_values));
+                    }
+                    else {
+                        ints = PVector<int64_t>(std::move(int_values));
+                    }
+                }
+            }
+            else if (auto integer = dynamic_cast<const Integer*>(obj.get())) {
+                int_value = integer->get();
+            }
+            else if (auto num = dynamic_cast<const Numeric*>(obj.get())) {
+                float_value = num->to_double();
+                is_float = true;
+            }
+            else {
+                create<TypeError>("Expected a list or a number, got a " + obj->obj_type()->name())->raise();
+            }
+        }
+
+        std::size_t size() const { return is_float ? floats.size() : ints.size(); }
+
+        void to_float() {
+            if (!is_float) {
+                floats = PVector<double>(std::vector<double>(ints.begin(), ints.end()));
+                float_value = int_value;
+                is_float = true;
+            }
+        }
+    };
+
+    template<typename T, typename Op>
+    PVector<T> apply_elementwise(const PVector<T>& a, const PVector<T>& b, bool b_is_list, T b_value, Op op) {
+        std::vector<T> res(a.size());
+        for (std::size_t i = 0; i < a.size(); i += PVector<T>::CHUNK) {
+            auto count = std::min(PVector<T>::CHUNK, a.size() - i);
+            if (b_is_list) {
+                kernels::elementwise(a.chunk(i), b.chunk(i), res.data() + i, count, op);
+            }
+            else {
+                kernels::elementwise(a.chunk(i), b_value, res.data() + i, count, op);
+            }
+        }
+        return PVector<T>(std::move(res));
+    }
+
+    // Applies op to each element and the matching element of other (or other itself), in integers where both sides
+    // are integers and always_float isn't set
+    template<typename Op> ObjectRef elementwise_op(Op op, bool always_float = false) {
+        return create<BuiltinFunction>([op, always_float](std::shared_ptr<const List> self, ObjectRef other) {
+            NumericOperand a(self), b(other);
+            if (b.is_list && a.size() != b.size()) {
+                create<ValueError>("Expected lists of the same size, got " + std::to_string(a.size()) + " and " + std::to_string(b.size()))->raise();
+            }
+            if (always_float || a.is_float || b.is_float) {
+                a.to_float();
+                b.to_float();
+                return create<List>(apply_elementwise(a.floats, b.floats, b.is_list, b.float_value, [op](double x, double y) { return op(x, y); }));
+            }
+            return create<List>(apply_elementwise(a.ints, b.ints, b.is_list, b.int_value, [op](int64_t x, int64_t y) { return op(x, y); }));
+        });
+    }
+}
+
 TypeRef List::type = create<Type>("List", Type::basevec{Object::type}, Type::attrmap{
     {"[]", create<BuiltinFunction>([](const List* self, const Integer* idx) {
-        if (idx->get() < 0 || idx->get() >= static_cast<int64_t>(self->value.size())) {
-            create<IndexError>("Index " + idx->to_str() + " is out of bounds for list of size " + std::to_string(self->value.size()))->raise();
+        if (idx->get() < 0 || idx->get() >= static_cast<int64_t>(self->size())) {
+            create<IndexError>("Index " + idx->to_str() + " is out of bounds for list of size " + std::to_string(self->size()))->raise();
         }
-        return self->value[idx->get()];
+        return self->item(idx->get());
     })},
     {"__iter__", create<BuiltinFunction>([](std::shared_ptr<const List> self) -> ObjectRef {
         return create<ListIterator>(self, 0);
     })},
     {"==", create<BuiltinFunction>([](const List* self, ObjectRef other) -> BaseObjectRef {
         if (auto other_l = dynamic_cast<const List*>(other.get())) {
-            if (self->value.size() != other_l->value.size()) {
+            if (self->size() != other_l->size()) {
                 return Boolean::false_;
             }
-            for (auto iter_a = self->value.begin(), iter_b = other_l->value.begin(); iter_a != self->value.end(); ++iter_a, ++iter_b) {
-                if (!(*iter_a)->eq(*iter_b)) {
+            if (self->value.index() && self->value.index() == other_l->value.index()) {
+                return std::visit([other_l](auto& values) -> BaseObjectRef {
+                    using V = std::decay_t<decltype(values)>;
+                    if constexpr (std::is_same_v<V, PVector<ObjectRef>>) {
+                        return nullptr;
+                    }
+                    else {
+                        return typed_equal(values, std::get<V>(other_l->value)) ? Boolean::true_ : Boolean::false_;
+                    }
+                }, self->value);
+            }
+            for (std::size_t i = 0; i < self->size(); ++i) {
+                if (!self->item(i)->eq(other_l->item(i))) {
                     return Boolean::false_;
                 }
             }
@@ -644,25 +1176,144 @@ TypeRef List::type = create<Type>("List", Type::basevec{Object::type}, Type::att
         }
         return self->getsuper(List::type, "==")->call({other});
     })},
+    {"rin", create<BuiltinFunction>([](const List* self, ObjectRef obj) -> BaseObjectRef {
+        auto index = self->value.index();
+        if (index && index == storage_index(*obj)) {
+            return std::visit([&obj](auto& values) {
+                using T = typename std::decay_t<decltype(values)>::const_iterator::value_type;
+                if constexpr (std::is_same_v<T, ObjectRef>) {
+                    return false;
+                }
+                else {
+                    auto value = unbox<T>(*obj);
+                    bool found = false;
+                    values.for_each_chunk([&](const T* data, std::size_t count) {
+                        found = found || kernels::contains(data, count, value);
+                    });
+                    return found;
+                }
+            }, self->value) ? Boolean::true_ : Boolean::false_;
+        }
+        for (std::size_t i = 0; i < self->size(); ++i) {
+            if (ObjectRefEq{}(self->item(i), obj)) {
+                return Boolean::true_;
+            }
+        }
+        return Boolean::false_;
+    })},
     {":+", create<BuiltinFunction>([](const List* self, ObjectRef obj) {
-        std::vector<ObjectRef> res = self->value;
-        res.push_back(obj);
-        return create<List>(res);
+        auto index = storage_index(*obj);
+        if (index && (index == self->value.index() || !self->size())) {
+            switch (index) {
+                case 1: return create<List>(append_unboxed<int64_t>(self->value, *obj));
+                case 2: return create<List>(append_unboxed<double>(self->value, *obj));
+                default: return create<List>(append_unboxed<uint8_t>(self->value, *obj));
+            }
+        }
+        return create<List>(self->get().push_back(std::move(obj)));
+    })},
+    // Empty lists sum to 0, typed lists are summed in bulk and others with +
+    {"sum", create<BuiltinFunction>([](const List* self) {
+        if (!self->size()) {
+            return box(int64_t(0));
+        }
+        return std::visit([](auto& values) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(values)>, PVector<ObjectRef>>) {
+                auto total = values[0];
+                for (std::size_t i = 1; i < values.size(); ++i) {
+                    total = total->gettype("+")->call_no_thunks({values[i]});
+                }
+                return total;
+            }
+            else {
+                return typed_sum(values);
+            }
+        }, self->value);
+    })},
+    {"min", create<BuiltinFunction>([](const List* self) {
+        return extreme<false>(self);
     })},
+    {"max", create<BuiltinFunction>([](const List* self) {
+        return extreme<true>(self);
+    })},
+    {"add", elementwise_op([](auto x, auto y) { return x + y; })},
+    {"sub", elementwise_op([](auto x, auto y) { return x - y; })},
+    {"mul", elementwise_op([](auto x, auto y) { return x * y; })},
+    {"div", elementwise_op([](auto x, auto y) { return x / y; }, true)},
 });
 
-List::List(TypeRef type, std::vector<ObjectRef> v) : Object(type), value(v) {
+List::List(TypeRef type, std::vector<ObjectRef> v) : Object(type), value(pack(std::move(v))) {
+}
+
+List::List(TypeRef type, Storage v) : Object(type), value(std::move(v)) {
+}
+
+List::~List() {
+    if (auto objects = std::get_if<PVector<ObjectRef>>(&value)) {
+        std::vector<ObjectRef> pending;
+        objects->release(pending);
+        release_nested(std::move(pending));
+    }
+}
+
+std::size_t List::size() const {
+    return std::visit([](auto& values) { return values.size(); }, value);
+}
+
+ObjectRef List::item(std::size_t index) const {
+    return std::visit([index](auto& values) { return box(values[index]); }, value);
+}
+
+const PVector<ObjectRef>& List::get() const {
+    if (auto objects = std::get_if<PVector<ObjectRef>>(&value)) {
+        return *objects;
+    }
+    std::call_once(boxed_once, [this]() {
+        std::vector<ObjectRef> items;
+        items.reserve(size());
+        std::visit([&items](auto& values) {
+            for (auto& v : values) {
+                items.push_back(box(v));
+            }
+        }, value);
+        boxed = std::make_unique<const PVector<ObjectRef>>(std::move(items));
+    });
+    return *boxed;
+}
+
+void release_nested(std::vector<ObjectRef> pending) {
+    while (pending.size()) {
+        auto obj = std::move(pending.back());
+        pending.pop_back();
+        if (obj.use_count() != 1) {
+            continue;
+        }
+        // obj is about to be destroyed, so its contents can be taken. Checked by exact type, which is cheaper than a cast;
+        // the language has no way to subclass them.
+        auto type = obj->obj_type().get();
+        if (type == List::type.get()) {
+            if (auto objects = std::get_if<PVector<ObjectRef>>(&const_cast<List&>(static_cast<const List&>(*obj)).value)) {
+                objects->release(pending);
+            }
+        }
+        else if (type == Dict::type.get()) {
+            const_cast<Dict&>(static_cast<const Dict&>(*obj)).value.release(pending);
+        }
+        else if (type == Set::type.get()) {
+            const_cast<Set&>(static_cast<const Set&>(*obj)).value.release(pending);
+        }
+    }
 }
 
 std::string List::to_str() const {
     std::stringstream ss;
     ss << "[";
     bool first = true;
-    for (auto item : value) {
+    for (std::size_t i = 0; i < size(); ++i) {
         if (!first) {
             ss << ", ";
         }
-        ss << item;
+        ss << item(i);
         first = false;
     }
     ss << "]";
@@ -674,13 +1325,68 @@ TypeRef ListIterator::type = create<Type>("ListIterator", Type::basevec{Object::
         return self;
     })},
     {"__next__", create<BuiltinFunction>([](const ListIterator* self) -> ObjectRef {
-        if (self->position >= self->list->get().size() ) {
+        if (self->position >= self->list->size()) {
             return NoneType::none;
         }
-        std::vector<ObjectRef> res = {create<ListIterator>(self->list, self->position + 1), self->list->get()[self->position]};
+        std::vector<ObjectRef> res = {create<ListIterator>(self->list, self->position + 1), self->list->item(self->position)};
         return create<List>(res);
     })}
 });
 
 ListIterator::ListIterator(TypeRef type, std::shared_ptr<const List> list, unsigned int position) : Object(type), list(list), position(position) {
 }
+
+TypeRef NativeIterator::type = create<Type>("NativeIterator", Type::basevec{Object::type});
+
+ObjectRef NativeIterator::exhausted() {
+    static const ObjectRef done = create<ListIterator>(create<List>(std::vector<ObjectRef>{}));
+    return done;
+}
+
+namespace {
+    const ObjectRef& cursor_value(const ObjectRef& item) { return item; }
+    template<typename V> const ObjectRef& cursor_value(const std::pair<ObjectRef, V>& item) { return item.first; }
+    template<typename T> ObjectRef cursor_value(T value) { return box(value); }
+
+    // Steps a container's own iterator, keeping the container alive. Dicts and sets give their keys.
+    template<typename C, typename Iter>
+    class ContainerCursor : public NativeIterator {
+        std::shared_ptr<const C> container;
+        mutable Iter position;
+        Iter end;
+    public:
+        ContainerCursor(TypeRef type, std::shared_ptr<const C> container, Iter position, Iter end)
+            : NativeIterator(type), container(std::move(container)), position(position), end(end) {}
+        bool next(ObjectRef& value) const override {
+            if (position == end) {
+                return false;
+            }
+            value = cursor_value(*position);
+            ++position;
+            return true;
+        }
+        std::shared_ptr<const NativeIterator> clone() const override {
+            return std::make_shared<ContainerCursor>(*this);
+        }
+    };
+
+    template<typename C, typename Iter>
+    std::shared_ptr<const NativeIterator> make_cursor(std::shared_ptr<const C> container, Iter position, Iter end) {
+        return std::make_shared<ContainerCursor<C, Iter>>(NativeIterator::type, std::move(container), position, end);
+    }
+}
+
+std::shared_ptr<const NativeIterator> ListIterator::native_iter() const {
+    // Typed storage is boxed an element at a time
+    return std::visit([this](auto& values) {
+        return make_cursor(list, typename std::decay_t<decltype(values)>::const_iterator(&values, position), values.end());
+    }, list->storage());
+}
+
+std::shared_ptr<const NativeIterator> SetIterator::native_iter() const {
+    return make_cursor(set, position, set->get().end());
+}
+
+std::shared_ptr<const NativeIterator> DictIterator::native_iter() const {
+    return make_cursor(dict, position, dict->get().end());
+}
@@ -1,13 +1,21 @@
 #ifndef OBJECT_HPP
 #define OBJECT_HPP
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
-#include <unordered_map>
 #include <functional>
+#include <mutex>
 #include <stdexcept>
+#include <variant>
+
+#include "flathashmap.hpp"
+#include "phashmap.hpp"
+#include "pvector.hpp"
+#include "rope.hpp"
 
 class BaseObject : public std::enable_shared_from_this<BaseObject> {
 public:
@@ -19,6 +27,7 @@ class Object;
 using ObjectRef = std::shared_ptr<const Object>;
 class Type;
 using TypeRef = std::shared_ptr<const Type>;
+class NativeIterator;
 
 class Object : public BaseObject {
     TypeRef type_;
@@ -29,20 +38,22 @@ public:
     virtual bool to_bool() const;
     virtual std::size_t hash() const;
     bool eq(ObjectRef other) const;
-    TypeRef obj_type() const;
+    const TypeRef& obj_type() const;
     // TODO: The below doesn't seem quite right. Intuitively, getattr is a function provided by the type. But this works for now.
     ObjectRef getsuper(TypeRef type, std::string name) const;
     ObjectRef gettype(std::string name) const;
     virtual BaseObjectRef getattr(std::string name) const;
     virtual BaseObjectRef call(const std::vector<ObjectRef>& args) const;
     ObjectRef call_no_thunks(const std::vector<ObjectRef>& args) const;
+    // A fresh cursor for FOR_ITER, or null for iterators that only have __next__
+    virtual std::shared_ptr<const NativeIterator> native_iter() const;
     ObjectRef self() const { return std::dynamic_pointer_cast<const Object>(BaseObject::shared_from_this());}
 
     friend std::vector<TypeRef> make_top_types();
 };
 
-template<class T, class... Args> std::shared_ptr<const T> create(Args... args) {
-    return std::make_shared<T>(T::type, args...);
+template<class T, class... Args> std::shared_ptr<const T> create(Args&&... args) {
+    return std::make_shared<T>(T::type, std::forward<Args>(args)...);
 }
 
 std::ostream& operator<<(std::ostream& s, const ObjectRef& obj);
@@ -50,7 +61,8 @@ std::ostream& operator<<(std::ostream& s, const ObjectRef& obj);
 class Type : public Object {
     std::string name_;
     std::vector<TypeRef> bases_, mro_;
-    std::map<std::string, ObjectRef> attrs_;
+    // Sorted by name, fixed once the type is built
+    std::vector<std::pair<std::string, ObjectRef>> attrs_;
 
     static std::vector<TypeRef> make_mro(const std::vector<TypeRef>& bases);
 public:
@@ -61,7 +73,8 @@ public:
     BaseObjectRef call(const std::vector<ObjectRef>& args) const override;
     std::string name() const { return name_; }
     const std::vector<TypeRef>& mro() const { return mro_; }
-    const std::map<std::string, ObjectRef>& attrs() const { return attrs_; }
+    // Only looks at this type's own attributes, returning null if there is no such attribute
+    const ObjectRef* find_attr(std::string_view name) const;
 
     using attrmap = std::map<std::string, ObjectRef>;
     using basevec = std::vector<TypeRef>;
@@ -76,9 +89,23 @@ public:
     std::string to_str() const override;
     static TypeRef type;
     bool to_bool() const override;
+    std::size_t hash() const override;
     static std::shared_ptr<const NoneType> none;
 };
 
+// A mutable cursor that FOR_ITER steps in place of the immutable __next__ protocol. Cursors only live on frame stacks
+// and are cloned when a frame saves its stack, so scripts never see one change.
+class NativeIterator : public Object {
+public:
+    using Object::Object;
+    static TypeRef type;
+    // Returns false once exhausted
+    virtual bool next(ObjectRef& value) const = 0;
+    virtual std::shared_ptr<const NativeIterator> clone() const = 0;
+    // An iterator whose __next__ is already done, left for the __next__ path to finish the loop with
+    static ObjectRef exhausted();
+};
+
 struct AbstractFunctionHolder {
     virtual BaseObjectRef call(const std::vector<ObjectRef>& args) const = 0;
     virtual ~AbstractFunctionHolder() = default;
@@ -137,6 +164,7 @@ public:
     int64_t get() const { return value; }
     double to_double() const override { return value; }
     bool to_bool() const override;
+    std::size_t hash() const override;
 };
 
 class Float : public Numeric {
@@ -148,6 +176,7 @@ public:
     double get() const { return value; }
     double to_double() const override { return value; }
     bool to_bool() const override;
+    std::size_t hash() const override;
 };
 
 class Boolean : public Integer {
@@ -159,22 +188,34 @@ public:
 };
 
 class String : public Object {
-    std::string value;
+    Rope<char> value;
+    // Computed on first use, so that building a string doesn't flatten it. 0 until then.
+    mutable std::atomic<std::size_t> hash_{0};
 public:
     String(TypeRef type, std::string v);
+    // The contents are a view into memory kept alive by owner (e.g. a mapped file)
+    String(TypeRef type, std::shared_ptr<const void> owner, std::string_view v);
+    String(TypeRef type, Rope<char> v);
     std::string to_str() const override;
     static TypeRef type;
-    std::string get() const { return value; }
+    // Valid while this string is
+    std::string_view get() const { return value.view(); }
+    const Rope<char>& rope() const { return value; }
     std::size_t hash() const override;
 };
 
 class Bytes : public Object {
-    std::basic_string<unsigned char> value;
+    Rope<unsigned char> value;
+    mutable std::atomic<std::size_t> hash_{0};
 public:
     Bytes(TypeRef type, std::basic_string<unsigned char> v);
+    Bytes(TypeRef type, std::shared_ptr<const void> owner, std::basic_string_view<unsigned char> v);
+    Bytes(TypeRef type, Rope<unsigned char> v);
     std::string to_str() const override;
     static TypeRef type;
-    std::basic_string<unsigned char> get() const { return value; }
+    std::basic_string_view<unsigned char> get() const { return value.view(); }
+    const Rope<unsigned char>& rope() const { return value; }
+    std::size_t hash() const override;
 };
 
 class BoundMethod : public Object {
@@ -201,30 +242,110 @@ struct ObjectRefHash {
     }
 };
 
+// Primitives of the same type are compared directly, anything else goes through ==
 struct ObjectRefEq {
     inline bool operator()(const ObjectRef& lhs, const ObjectRef& rhs) const {
+        if (lhs == rhs) {
+            return true;
+        }
+        auto type = lhs->obj_type().get();
+        if (type == rhs->obj_type().get()) {
+            if (type == String::type.get()) {
+                return static_cast<const String&>(*lhs).get() == static_cast<const String&>(*rhs).get();
+            }
+            if (type == Integer::type.get()) {
+                return static_cast<const Integer&>(*lhs).get() == static_cast<const Integer&>(*rhs).get();
+            }
+            if (type == Float::type.get()) {
+                return static_cast<const Float&>(*lhs).get() == static_cast<const Float&>(*rhs).get();
+            }
+            if (type == Bytes::type.get()) {
+                return static_cast<const Bytes&>(*lhs).get() == static_cast<const Bytes&>(*rhs).get();
+            }
+        }
         return lhs->eq(rhs);
     }
 };
 
-using ObjectRefMap = std::unordered_map<ObjectRef, ObjectRef, ObjectRefHash, ObjectRefEq>;
+using ObjectRefMap = FlatHashMap<ObjectRef, ObjectRef, ObjectRefHash, ObjectRefEq>;
+using DictMap = PHashMap<ObjectRef, ObjectRef, ObjectRefHash, ObjectRefEq>;
+
+// Drops the references, taking apart lists and dicts that nothing else refers to one at a time instead of recursively
+void release_nested(std::vector<ObjectRef> pending);
 
 class Dict : public Object {
-    ObjectRefMap value;
+    DictMap value;
 public:
-    Dict(TypeRef type, ObjectRefMap v);
+    Dict(TypeRef type, const ObjectRefMap& v);
+    Dict(TypeRef type, DictMap v);
+    ~Dict() override;
     std::string to_str() const override;
     static TypeRef type;
-    const ObjectRefMap& get() const { return value; }
+    // Use lookup() or at() for keys, set/remove/merge give new maps sharing structure with this one
+    const DictMap& get() const { return value; }
+
+    friend void release_nested(std::vector<ObjectRef> pending);
+};
+
+// Sets are maps to nothing
+struct SetValue {};
+using SetMap = PHashMap<ObjectRef, SetValue, ObjectRefHash, ObjectRefEq>;
+
+class DictIterator : public Object {
+    std::shared_ptr<const Dict> dict;
+    DictMap::const_iterator position;
+public:
+    DictIterator(TypeRef type, std::shared_ptr<const Dict> dict, DictMap::const_iterator position);
+    static TypeRef type;
+    std::shared_ptr<const NativeIterator> native_iter() const override;
+};
+
+class Set : public Object {
+    SetMap value;
+public:
+    Set(TypeRef type, SetMap v);
+    ~Set() override;
+    std::string to_str() const override;
+    static TypeRef type;
+    bool contains(const ObjectRef& obj) const { return value.contains(obj); }
+    const SetMap& get() const { return value; }
+
+    friend void release_nested(std::vector<ObjectRef> pending);
+};
+
+class SetIterator : public Object {
+    std::shared_ptr<const Set> set;
+    SetMap::const_iterator position;
+public:
+    SetIterator(TypeRef type, std::shared_ptr<const Set> set, SetMap::const_iterator position);
+    static TypeRef type;
+    std::shared_ptr<const NativeIterator> native_iter() const override;
 };
 
 class List : public Object {
-    std::vector<ObjectRef> value;
+public:
+    // Lists whose elements all have exactly type Integer, Float or Boolean keep them unboxed, in that order after the
+    // first alternative
+    using Storage = std::variant<PVector<ObjectRef>, PVector<int64_t>, PVector<double>, PVector<uint8_t>>;
+private:
+    Storage value;
+    mutable std::once_flag boxed_once;
+    mutable std::unique_ptr<const PVector<ObjectRef>> boxed;
 public:
     List(TypeRef type, std::vector<ObjectRef> v);
+    List(TypeRef type, Storage v);
+    ~List() override;
     std::string to_str() const override;
     static TypeRef type;
-    const std::vector<ObjectRef>& get() const { return value; }
+    std::size_t size() const;
+    // Boxes a single element of typed storage
+    ObjectRef item(std::size_t index) const;
+    const Storage& storage() const { return value; }
+    // Indexable and iterable, use to_vector() for a std::vector. Typed storage is boxed (once) on the first call, so
+    // prefer size() and item() where they will do.
+    const PVector<ObjectRef>& get() const;
+
+    friend void release_nested(std::vector<ObjectRef> pending);
 };
 
 class ListIterator : public Object {
@@ -233,6 +354,7 @@ class ListIterator : public Object {
 public:
     ListIterator(TypeRef type, std::shared_ptr<const List> list, unsigned int position=0);
     static TypeRef type;
+    std::shared_ptr<const NativeIterator> native_iter() const override;
 };
 
 #endif // OBJECT_HPP
@@ -0,0 +1,315 @@
+#ifndef PHASHMAP_HPP
+#define PHASHMAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A persistent hash map: a hash array mapped trie using 5 bits of the hash per level. Versions share structure, so
+// set and remove copy only the nodes on the path to the key. Nodes hold their entries and their children in two
+// compact arrays indexed by popcount of a bitmap. Keys whose hashes are fully equal end up together in a collision
+// node, which is searched linearly.
+template<typename K, typename V, typename Hash, typename Eq>
+class PHashMap {
+    static constexpr unsigned int BITS = 5, MASK = (1u << BITS) - 1, MAX_SHIFT = 64;
+
+    struct Node {
+        uint32_t datamap = 0, nodemap = 0;
+        bool collision = false;
+        std::vector<std::pair<K, V>> entries;
+        std::vector<std::shared_ptr<const Node>> children;
+    };
+    using NodeRef = std::shared_ptr<const Node>;
+
+    NodeRef root = std::make_shared<const Node>();
+    std::size_t size_ = 0;
+
+    static uint32_t bit_for(std::size_t hash, unsigned int shift) {
+        return 1u << ((hash >> shift) & MASK);
+    }
+    static unsigned int index_for(uint32_t map, uint32_t bit) {
+        return __builtin_popcount(map & (bit - 1));
+    }
+
+    static NodeRef merge(unsigned int shift, std::pair<K, V> a, std::size_t hash_a, std::pair<K, V> b, std::size_t hash_b) {
+        auto node = std::make_shared<Node>();
+        if (shift >= MAX_SHIFT) {
+            node->collision = true;
+            node->entries.push_back(std::move(a));
+            node->entries.push_back(std::move(b));
+            return node;
+        }
+        auto bit_a = bit_for(hash_a, shift), bit_b = bit_for(hash_b, shift);
+        if (bit_a == bit_b) {
+            node->nodemap = bit_a;
+            node->children.push_back(merge(shift + BITS, std::move(a), hash_a, std::move(b), hash_b));
+        }
+        else {
+            node->datamap = bit_a | bit_b;
+            if (bit_a > bit_b) {
+                std::swap(a, b);
+            }
+            node->entries.push_back(std::move(a));
+            node->entries.push_back(std::move(b));
+        }
+        return node;
+    }
+
+    static NodeRef set_in(const Node& node, unsigned int shift, std::size_t hash, const K& key, const V& value, bool& added) {
+        auto copy = std::make_shared<Node>(node);
+        if (node.collision) {
+            for (auto& entry : copy->entries) {
+                if (Eq{}(entry.first, key)) {
+                    entry.second = value;
+                    return copy;
+                }
+            }
+            copy->entries.emplace_back(key, value);
+            added = true;
+            return copy;
+        }
+        auto bit = bit_for(hash, shift);
+        if (node.datamap & bit) {
+            auto index = index_for(node.datamap, bit);
+            auto& entry = copy->entries[index];
+            if (Eq{}(entry.first, key)) {
+                entry.second = value;
+                return copy;
+            }
+            auto existing_hash = Hash{}(entry.first);
+            auto child = merge(shift + BITS, std::move(entry), existing_hash, {key, value}, hash);
+            copy->entries.erase(copy->entries.begin() + index);
+            copy->datamap &= ~bit;
+            copy->children.insert(copy->children.begin() + index_for(node.nodemap, bit), std::move(child));
+            copy->nodemap |= bit;
+            added = true;
+        }
+        else if (node.nodemap & bit) {
+            auto& child = copy->children[index_for(node.nodemap, bit)];
+            child = set_in(*child, shift + BITS, hash, key, value, added);
+        }
+        else {
+            copy->entries.insert(copy->entries.begin() + index_for(node.datamap, bit), {key, value});
+            copy->datamap |= bit;
+            added = true;
+        }
+        return copy;
+    }
+
+    // Returns null if the key isn't there, so that unchanged paths are not copied
+    static NodeRef remove_from(const Node& node, unsigned int shift, std::size_t hash, const K& key) {
+        if (node.collision) {
+            for (auto iter = node.entries.begin(); iter != node.entries.end(); ++iter) {
+                if (Eq{}(iter->first, key)) {
+                    auto copy = std::make_shared<Node>(node);
+                    copy->entries.erase(copy->entries.begin() + (iter - node.entries.begin()));
+                    return copy;
+                }
+            }
+            return nullptr;
+        }
+        auto bit = bit_for(hash, shift);
+        if (node.datamap & bit) {
+            auto index = index_for(node.datamap, bit);
+            if (!Eq{}(node.entries[index].first, key)) {
+                return nullptr;
+            }
+            auto copy = std::make_shared<Node>(node);
+            copy->entries.erase(copy->entries.begin() + index);
+            copy->datamap &= ~bit;
+            return copy;
+        }
+        if (node.nodemap & bit) {
+            auto index = index_for(node.nodemap, bit);
+            auto child = remove_from(*node.children[index], shift + BITS, hash, key);
+            if (!child) {
+                return nullptr;
+            }
+            auto copy = std::make_shared<Node>(node);
+            if (child->entries.empty() && child->children.empty()) {
+                copy->children.erase(copy->children.begin() + index);
+                copy->nodemap &= ~bit;
+            }
+            else if (child->entries.size() == 1 && child->children.empty()) {
+                // A lone entry moves back up into this node
+                copy->children.erase(copy->children.begin() + index);
+                copy->nodemap &= ~bit;
+                copy->entries.insert(copy->entries.begin() + index_for(node.datamap, bit), child->entries.front());
+                copy->datamap |= bit;
+            }
+            else {
+                copy->children[index] = std::move(child);
+            }
+            return copy;
+        }
+        return nullptr;
+    }
+
+    template<typename T>
+    static void release_node(const NodeRef& node, std::vector<T>& out) {
+        if (!node || node.use_count() != 1) {
+            return;
+        }
+        auto& mutable_node = const_cast<Node&>(*node);
+        for (auto& child : mutable_node.children) {
+            release_node(child, out);
+        }
+        for (auto& entry : mutable_node.entries) {
+            out.push_back(std::move(entry.first));
+            // Sets use an empty value type
+            if constexpr (!std::is_empty_v<V>) {
+                out.push_back(std::move(entry.second));
+            }
+        }
+        mutable_node.entries.clear();
+    }
+
+public:
+    using value_type = std::pair<K, V>;
+
+    class const_iterator {
+        // For each node on the path, the next entry or child (after the entries) to visit
+        std::vector<std::pair<const Node*, std::size_t>> stack;
+        const std::pair<K, V>* current = nullptr;
+
+        void advance() {
+            current = nullptr;
+            while (!stack.empty()) {
+                auto node = stack.back().first;
+                auto next = stack.back().second++;
+                if (next < node->entries.size()) {
+                    current = &node->entries[next];
+                    return;
+                }
+                if (next - node->entries.size() < node->children.size()) {
+                    stack.emplace_back(node->children[next - node->entries.size()].get(), 0);
+                    continue;
+                }
+                stack.pop_back();
+            }
+        }
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::pair<K, V>;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        const_iterator() = default;
+        explicit const_iterator(const Node* root) {
+            stack.emplace_back(root, 0);
+            advance();
+        }
+        reference operator*() const { return *current; }
+        pointer operator->() const { return current; }
+        const_iterator& operator++() {
+            advance();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            auto copy = *this;
+            advance();
+            return copy;
+        }
+        bool operator==(const const_iterator& other) const { return current == other.current; }
+        bool operator!=(const const_iterator& other) const { return current != other.current; }
+    };
+
+    PHashMap() = default;
+    template<typename Iter>
+    PHashMap(Iter begin, Iter end) {
+        for (; begin != end; ++begin) {
+            insert(begin->first, begin->second);
+        }
+    }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const_iterator begin() const { return const_iterator(root.get()); }
+    const_iterator end() const { return {}; }
+
+    // Returns null if there is no such key
+    const V* lookup(const K& key) const {
+        auto hash = Hash{}(key);
+        auto node = root.get();
+        for (unsigned int shift = 0;; shift += BITS) {
+            if (node->collision) {
+                for (auto& entry : node->entries) {
+                    if (Eq{}(entry.first, key)) {
+                        return &entry.second;
+                    }
+                }
+                return nullptr;
+            }
+            auto bit = bit_for(hash, shift);
+            if (node->datamap & bit) {
+                auto& entry = node->entries[index_for(node->datamap, bit)];
+                return Eq{}(entry.first, key) ? &entry.second : nullptr;
+            }
+            if (!(node->nodemap & bit)) {
+                return nullptr;
+            }
+            node = node->children[index_for(node->nodemap, bit)].get();
+        }
+    }
+
+    const V& at(const K& key) const {
+        if (auto value = lookup(key)) {
+            return *value;
+        }
+        throw std::out_of_range("Key not in map");
+    }
+
+    bool contains(const K& key) const {
+        return lookup(key) != nullptr;
+    }
+
+    // Adds or replaces in place. Other versions are unaffected, since changed nodes are copied.
+    void insert(const K& key, const V& value) {
+        bool added = false;
+        root = set_in(*root, 0, Hash{}(key), key, value, added);
+        size_ += added;
+    }
+
+    PHashMap set(const K& key, const V& value) const {
+        auto copy = *this;
+        copy.insert(key, value);
+        return copy;
+    }
+
+    PHashMap remove(const K& key) const {
+        auto copy = *this;
+        if (auto new_root = remove_from(*root, 0, Hash{}(key), key)) {
+            copy.root = std::move(new_root);
+            --copy.size_;
+        }
+        return copy;
+    }
+
+    // Entries of other replace those with equal keys
+    PHashMap merge(const PHashMap& other) const {
+        if (empty()) {
+            return other;
+        }
+        auto copy = *this;
+        for (auto& entry : other) {
+            copy.insert(entry.first, entry.second);
+        }
+        return copy;
+    }
+
+    // Moves the keys and values held only by this version into out, leaving any shared with other versions in place
+    template<typename T>
+    void release(std::vector<T>& out) {
+        release_node(root, out);
+        root.reset();
+        size_ = 0;
+    }
+};
+
+#endif // PHASHMAP_HPP
@@ -0,0 +1,191 @@
+#ifndef PVECTOR_HPP
+#define PVECTOR_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+// A persistent vector: a 32-way trie of full leaves plus a tail holding the last (up to 32) elements. Versions share
+// structure, so push_back copies at most one leaf and one path instead of the whole vector, and indexing walks at most
+// a handful of levels.
+template<typename T>
+class PVector {
+    static constexpr unsigned int BITS = 5, WIDTH = 1u << BITS, MASK = WIDTH - 1;
+
+    // Branches use children, leaves use values
+    struct Node {
+        std::vector<std::shared_ptr<const Node>> children;
+        std::vector<T> values;
+    };
+    using NodeRef = std::shared_ptr<const Node>;
+
+    NodeRef root = std::make_shared<const Node>();
+    std::vector<T> tail;
+    std::size_t size_ = 0;
+    unsigned int shift = BITS;
+
+    std::size_t tail_offset() const {
+        return size_ < WIDTH ? 0 : ((size_ - 1) >> BITS) << BITS;
+    }
+
+    const std::vector<T>& leaf_for(std::size_t index) const {
+        if (index >= tail_offset()) {
+            return tail;
+        }
+        auto node = root.get();
+        for (auto level = shift; level > 0; level -= BITS) {
+            node = node->children[(index >> level) & MASK].get();
+        }
+        return node->values;
+    }
+
+    static NodeRef new_path(unsigned int level, NodeRef node) {
+        while (level > 0) {
+            auto branch = std::make_shared<Node>();
+            branch->children.push_back(std::move(node));
+            node = std::move(branch);
+            level -= BITS;
+        }
+        return node;
+    }
+
+    // Copies the path to where the leaf holding indices [index, index + WIDTH) goes
+    NodeRef push_leaf(unsigned int level, const Node& parent, std::size_t index, NodeRef leaf) const {
+        auto copy = std::make_shared<Node>(parent);
+        auto child_index = (index >> level) & MASK;
+        if (level == BITS) {
+            copy->children.push_back(std::move(leaf));
+        }
+        else if (child_index < parent.children.size()) {
+            copy->children[child_index] = push_leaf(level - BITS, *parent.children[child_index], index, std::move(leaf));
+        }
+        else {
+            copy->children.push_back(new_path(level - BITS, std::move(leaf)));
+        }
+        return copy;
+    }
+
+    // Moves the full tail into the trie
+    void commit_tail() {
+        auto leaf = std::make_shared<Node>();
+        leaf->values = std::move(tail);
+        tail.clear();
+        auto index = size_ - WIDTH;
+        if ((index >> BITS) >= (std::size_t(1) << shift)) {
+            auto new_root = std::make_shared<Node>();
+            new_root->children.push_back(root);
+            new_root->children.push_back(new_path(shift, std::move(leaf)));
+            root = std::move(new_root);
+            shift += BITS;
+        }
+        else {
+            root = push_leaf(shift, *root, index, std::move(leaf));
+        }
+    }
+
+    void append(T value) {
+        if (tail.size() == WIDTH) {
+            commit_tail();
+        }
+        if (tail.capacity() < WIDTH) {
+            tail.reserve(WIDTH);
+        }
+        tail.push_back(std::move(value));
+        ++size_;
+    }
+
+    static void release_node(const NodeRef& node, std::vector<T>& out) {
+        if (node.use_count() != 1) {
+            return;
+        }
+        auto& mutable_node = const_cast<Node&>(*node);
+        for (auto& child : mutable_node.children) {
+            release_node(child, out);
+        }
+        std::move(mutable_node.values.begin(), mutable_node.values.end(), std::back_inserter(out));
+        mutable_node.values.clear();
+    }
+
+public:
+    // Elements are contiguous in runs of this many, starting at multiples of it
+    static constexpr std::size_t CHUNK = WIDTH;
+
+    class const_iterator {
+        const PVector* vector;
+        std::size_t index;
+        const T* leaf = nullptr;
+
+        void load_leaf() {
+            leaf = index < vector->size_ ? vector->leaf_for(index).data() : nullptr;
+        }
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator(const PVector* vector, std::size_t index) : vector(vector), index(index) {
+            load_leaf();
+        }
+        reference operator*() const { return leaf[index & MASK]; }
+        pointer operator->() const { return &leaf[index & MASK]; }
+        const_iterator& operator++() {
+            if ((++index & MASK) == 0) {
+                load_leaf();
+            }
+            return *this;
+        }
+        const_iterator operator++(int) {
+            auto copy = *this;
+            ++*this;
+            return copy;
+        }
+        bool operator==(const const_iterator& other) const { return index == other.index; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+    };
+
+    PVector() = default;
+    PVector(std::vector<T> values) {
+        for (auto& value : values) {
+            append(std::move(value));
+        }
+    }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T& operator[](std::size_t index) const { return leaf_for(index)[index & MASK]; }
+    // The run holding index, which must be a multiple of CHUNK. It has min(CHUNK, size() - index) elements.
+    const T* chunk(std::size_t index) const { return leaf_for(index).data(); }
+    // Calls f(data, count) on each run in turn
+    template<typename F> void for_each_chunk(F f) const {
+        for (std::size_t i = 0; i < size_; i += CHUNK) {
+            f(chunk(i), std::min(CHUNK, size_ - i));
+        }
+    }
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, size_}; }
+
+    PVector push_back(T value) const {
+        auto copy = *this;
+        copy.append(std::move(value));
+        return copy;
+    }
+
+    std::vector<T> to_vector() const {
+        return std::vector<T>(begin(), end());
+    }
+
+    // Moves the elements held only by this version into out, leaving any shared with other versions in place
+    void release(std::vector<T>& out) {
+        std::move(tail.begin(), tail.end(), std::back_inserter(out));
+        tail.clear();
+        release_node(root, out);
+        root.reset();
+        size_ = 0;
+    }
+};
+
+#endif // PVECTOR_HPP
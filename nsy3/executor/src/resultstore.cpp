@@ -0,0 +1,107 @@
+#include "resultstore.hpp"
+#include "serialisation.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    const char MAGIC[8] = {'N', 'S', 'Y', '3', 'S', 'T', 'O', 'R'};
+    const unsigned int VERSION = 1;
+    const std::size_t HEADER_SIZE = sizeof(MAGIC) + 8;
+    const std::size_t ENTRY_SIZE = 16;
+
+    void write_u32(std::ostream& stream, unsigned int v) {
+        stream.write(reinterpret_cast<const char*>(&v), 4);
+    }
+
+    unsigned int read_u32(const char* data) {
+        unsigned int v;
+        std::memcpy(&v, data, 4);
+        return v;
+    }
+}
+
+void write_result_store(const std::string& fname, const std::map<std::string, ObjectRef>& values) {
+    std::string keys, blob;
+    std::vector<unsigned int> entries;
+    auto keys_start = HEADER_SIZE + ENTRY_SIZE * values.size();
+    for (auto& item : values) {
+        entries.push_back(keys_start + keys.size());
+        entries.push_back(item.first.size());
+        keys += item.first;
+    }
+    auto values_start = keys_start + keys.size();
+    for (auto& item : values) {
+        Serialiser serialiser;
+        serialiser.write(item.second);
+        entries.push_back(values_start + blob.size());
+        entries.push_back(serialiser.data().size());
+        blob += serialiser.data();
+    }
+    if (values_start + blob.size() > 0xFFFFFFFFu) {
+        throw std::runtime_error("Result store too large");
+    }
+
+    std::ofstream f(fname, std::ios::binary);
+    if (!f) {
+        throw std::runtime_error("Could not open " + fname);
+    }
+    f.write(MAGIC, sizeof(MAGIC));
+    write_u32(f, VERSION);
+    write_u32(f, values.size());
+    // Keys and values were collected in two passes, interleave them into index entries
+    for (auto i = 0u; i < values.size(); ++i) {
+        write_u32(f, entries[2 * i]);
+        write_u32(f, entries[2 * i + 1]);
+        write_u32(f, entries[2 * (values.size() + i)]);
+        write_u32(f, entries[2 * (values.size() + i) + 1]);
+    }
+    f << keys << blob;
+    if (!f) {
+        throw std::runtime_error("Could not write " + fname);
+    }
+}
+
+ResultStore::ResultStore(const std::string& fname) : file(std::make_shared<const MappedFile>(fname)) {
+    if (file->size() < HEADER_SIZE || std::memcmp(file->data(), MAGIC, sizeof(MAGIC))) {
+        throw std::runtime_error(fname + " is not a result store");
+    }
+    if (read_u32(file->data() + sizeof(MAGIC)) != VERSION) {
+        throw std::runtime_error(fname + " has an unsupported result store version");
+    }
+    count_ = read_u32(file->data() + sizeof(MAGIC) + 4);
+    if (HEADER_SIZE + ENTRY_SIZE * count_ > file->size()) {
+        throw std::runtime_error(fname + " is truncated");
+    }
+}
+
+std::string_view ResultStore::key_at(unsigned int i) const {
+    auto entry = file->data() + HEADER_SIZE + ENTRY_SIZE * i;
+    return file->view().substr(read_u32(entry), read_u32(entry + 4));
+}
+
+ObjectRef ResultStore::lookup(std::string_view name) const {
+    unsigned int lo = 0, hi = count_;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        auto cmp = key_at(mid).compare(name);
+        if (cmp < 0) {
+            lo = mid + 1;
+        }
+        else if (cmp > 0) {
+            hi = mid;
+        }
+        else {
+            auto entry = file->data() + HEADER_SIZE + ENTRY_SIZE * mid + 8;
+            auto offset = read_u32(entry), len = read_u32(entry + 4);
+            if (offset + static_cast<std::size_t>(len) > file->size()) {
+                throw std::runtime_error("Result store value out of bounds");
+            }
+            auto data = file->view().substr(offset, len);
+            return deserialise_from_memory(data, file);
+        }
+    }
+    return nullptr;
+}
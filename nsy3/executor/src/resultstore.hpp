@@ -0,0 +1,33 @@
+#ifndef RESULTSTORE_HPP
+#define RESULTSTORE_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "object.hpp"
+#include "mappedfile.hpp"
+
+// Result store file layout (all integers are little endian u32):
+//   "NSY3STOR", version, count
+//   count index entries of {key offset, key length, value offset, value length}, sorted by key
+//   the keys (dotted dollar names), then the serialised values
+// Offsets are from the start of the file.
+
+void write_result_store(const std::string& fname, const std::map<std::string, ObjectRef>& values);
+
+class ResultStore {
+    // Shared with the strings and bytes looked up, which view into it
+    std::shared_ptr<const MappedFile> file;
+    unsigned int count_;
+
+    std::string_view key_at(unsigned int i) const;
+public:
+    ResultStore(const std::string& fname);
+    unsigned int size() const { return count_; }
+    // nullptr if the name is not in the store
+    ObjectRef lookup(std::string_view name) const;
+};
+
+#endif // RESULTSTORE_HPP
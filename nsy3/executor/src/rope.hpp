@@ -0,0 +1,159 @@
+#ifndef ROPE_HPP
+#define ROPE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Immutable text that shares its memory. A flat rope holds short text itself and longer text as a view into a
+// refcounted buffer, so slices of long text are views into the same buffer. Concatenations longer than FLAT_MAX link
+// the two ropes through a node instead of copying them, and are flattened into a buffer of their own the first time
+// they are read, so building a long string piece by piece is linear.
+template<typename CharT>
+class Rope {
+public:
+    using View = std::basic_string_view<CharT>;
+    using Str = std::basic_string<CharT>;
+    // Shorter concatenations are copied, which keeps leaves from getting tiny
+    static constexpr std::size_t FLAT_MAX = 256;
+
+private:
+    struct Node {
+        // Both set for a concatenation, never changed after construction
+        std::shared_ptr<const Node> left, right;
+        std::size_t size = 0;
+        // Set on construction for leaves, and when flattened for concatenations
+        mutable std::once_flag flattened;
+        mutable std::shared_ptr<const void> owner;
+        mutable View flat;
+
+        Node(std::shared_ptr<const void> owner, View flat) : size(flat.size()), owner(std::move(owner)), flat(flat) {}
+        Node(std::shared_ptr<const Node> left, std::shared_ptr<const Node> right)
+            : left(std::move(left)), right(std::move(right)), size(this->left->size + this->right->size) {}
+
+        // Long chains of concatenations are taken apart one node at a time instead of recursively
+        ~Node() {
+            std::vector<std::shared_ptr<const Node>> pending;
+            pending.push_back(std::move(left));
+            pending.push_back(std::move(right));
+            while (!pending.empty()) {
+                auto node = std::move(pending.back());
+                pending.pop_back();
+                if (node && node.use_count() == 1) {
+                    auto& mutable_node = const_cast<Node&>(*node);
+                    pending.push_back(std::move(mutable_node.left));
+                    pending.push_back(std::move(mutable_node.right));
+                }
+            }
+        }
+
+        // Only reads the parts of other nodes fixed at construction, so it is safe to run alongside their flattening
+        void flatten() const {
+            auto buffer = std::make_shared<Str>();
+            buffer->reserve(size);
+            std::vector<const Node*> todo = {right.get(), left.get()};
+            while (!todo.empty()) {
+                auto node = todo.back();
+                todo.pop_back();
+                if (node->left) {
+                    todo.push_back(node->right.get());
+                    todo.push_back(node->left.get());
+                }
+                else {
+                    buffer->append(node->flat);
+                }
+            }
+            flat = *buffer;
+            owner = std::move(buffer);
+        }
+    };
+    using NodeRef = std::shared_ptr<const Node>;
+
+    // Set only for a linked concatenation
+    NodeRef node;
+    // Otherwise the text is a view into memory kept alive by owner, or with no owner, local
+    std::shared_ptr<const void> owner;
+    View flat;
+    Str local;
+
+    explicit Rope(NodeRef node) : node(std::move(node)) {}
+
+    static NodeRef leaf(Str value) {
+        auto buffer = std::make_shared<const Str>(std::move(value));
+        View flat = *buffer;
+        return std::make_shared<Node>(std::move(buffer), flat);
+    }
+
+    // Linking is the only time a flat rope needs a node
+    NodeRef as_node() const {
+        if (node) {
+            return node;
+        }
+        if (owner) {
+            return std::make_shared<Node>(owner, flat);
+        }
+        return leaf(local);
+    }
+
+public:
+    Rope() = default;
+    Rope(Str value) {
+        if (value.size() <= FLAT_MAX) {
+            local = std::move(value);
+        }
+        else {
+            auto buffer = std::make_shared<const Str>(std::move(value));
+            flat = *buffer;
+            owner = std::move(buffer);
+        }
+    }
+    // A view into memory kept alive by owner. Without an owner the text is copied.
+    Rope(std::shared_ptr<const void> owner, View value) : owner(std::move(owner)), flat(value) {
+        if (!this->owner) {
+            *this = Rope(Str(value));
+        }
+    }
+
+    std::size_t size() const { return node ? node->size : owner ? flat.size() : local.size(); }
+    bool empty() const { return size() == 0; }
+
+    View view() const {
+        if (node) {
+            std::call_once(node->flattened, [this]() { node->flatten(); });
+            return node->flat;
+        }
+        return owner ? flat : View(local);
+    }
+
+    // Shares the buffer, flattening first if needed. Short text is copied.
+    Rope substr(std::size_t pos, std::size_t count = Str::npos) const {
+        auto value = view().substr(pos, count);
+        if (!node && !owner) {
+            return Rope(Str(value));
+        }
+        return Rope(node ? node->owner : owner, value);
+    }
+
+    Rope concat(const Rope& other) const {
+        if (other.empty()) {
+            return *this;
+        }
+        if (empty()) {
+            return other;
+        }
+        if (size() + other.size() <= FLAT_MAX) {
+            return Rope(Str(view()).append(other.view()));
+        }
+        // Appending short pieces one at a time grows the last leaf rather than adding a node for each
+        if (node && !node->right->left && node->right->size + other.size() <= FLAT_MAX) {
+            return Rope(std::make_shared<Node>(node->left, leaf(Str(node->right->flat).append(other.view()))));
+        }
+        return Rope(std::make_shared<Node>(as_node(), other.as_node()));
+    }
+};
+
+#endif // ROPE_HPP
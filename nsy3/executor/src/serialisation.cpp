@@ -3,124 +3,504 @@
 #include <stdexcept>
 #include <istream>
 #include <iostream>
+#include <cstring>
+#include <unordered_map>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
 
-enum class SerialisationType : char {
-    INT, FLOAT, STRING, DICT, SET, LIST, BYTES, TRUE, FALSE, NONE
-};
+namespace {
+    enum class SerialisationType : char {
+        INT, FLOAT, STRING, DICT, SET, LIST, BYTES, TRUE, FALSE, NONE,
+        // v2 only: a string that was already written, by index in the order of first appearance
+        STRING_REF
+    };
 
-ObjectRef deserialise_from_file(std::istream& stream) {
-    auto type = static_cast<SerialisationType>(stream.get());
-    switch (type) {
-        case SerialisationType::INT: {
-            char bytes[4];
-            stream.read(bytes, 4);
-            return create<Integer>(*reinterpret_cast<int*>(bytes));
-        }
-        case SerialisationType::FLOAT: {
-            char bytes[8];
-            stream.read(bytes, 8);
-            return create<Float>(*reinterpret_cast<double*>(bytes));
-        }
-        case SerialisationType::STRING: {
-            char bytes[4];
-            stream.read(bytes, 4);
-            auto len = *reinterpret_cast<unsigned int*>(bytes);
-            auto str = std::string(len, '\0');
-            stream.read(str.data(), len);
-            return create<String>(str);
-        }
-        case SerialisationType::LIST: {
-            char bytes[4];
-            stream.read(bytes, 4);
-            auto len = *reinterpret_cast<unsigned int*>(bytes);
-            std::vector<ObjectRef> objs;
-            for (auto i = 0u; i < len; ++i) {
-                objs.push_back(deserialise_from_file(stream));
+    // v2 data starts with this followed by the version. No v1 type tag is a letter.
+    const char MAGIC[3] = {'N', 'S', 'Y'};
+
+    // Reads straight from the stream's buffer: single bytes are inline and blocks are one sgetn, and nothing past the
+    // end of the object is consumed
+    class StreamSource {
+        std::streambuf* buffer;
+    public:
+        // Lengths can't be checked against the rest of a stream, so only this much is allocated up front
+        static constexpr std::size_t max_reserve = 4096;
+
+        StreamSource(std::istream& stream) : buffer(stream.rdbuf()) {
+            if (!buffer) {
+                throw std::runtime_error("Stream has no buffer");
+            }
+        }
+        std::size_t remaining() const {
+            return static_cast<std::size_t>(-1);
+        }
+        unsigned char peek() {
+            auto c = buffer->sgetc();
+            if (c == std::char_traits<char>::eof()) {
+                throw std::runtime_error("Unexpected end of serialised data");
+            }
+            return static_cast<unsigned char>(c);
+        }
+        unsigned char byte() {
+            auto c = buffer->sbumpc();
+            if (c == std::char_traits<char>::eof()) {
+                throw std::runtime_error("Unexpected end of serialised data");
+            }
+            return static_cast<unsigned char>(c);
+        }
+        void read(char* dest, std::size_t len) {
+            if (static_cast<std::size_t>(buffer->sgetn(dest, len)) != len) {
+                throw std::runtime_error("Unexpected end of serialised data");
+            }
+        }
+        template<class Str> Str read_string(std::size_t len) {
+            // Grow with the data actually read rather than trusting len
+            Str str;
+            while (str.size() < len) {
+                auto chunk = std::min(len - str.size(), max_reserve);
+                auto start = str.size();
+                str.resize(start + chunk);
+                read(reinterpret_cast<char*>(str.data() + start), chunk);
+            }
+            return str;
+        }
+        ObjectRef string(std::size_t len) {
+            return create<String>(read_string<std::string>(len));
+        }
+        ObjectRef bytes(std::size_t len) {
+            return create<Bytes>(read_string<std::basic_string<unsigned char>>(len));
+        }
+    };
+
+    class MemorySource {
+        std::string_view& data;
+        const std::shared_ptr<const void>& owner;
+
+        std::string_view take(std::size_t len) {
+            if (data.size() < len) {
+                throw std::runtime_error("Unexpected end of serialised data");
             }
-            return create<List>(objs);
-        }
-        case SerialisationType::DICT: {
-            char bytes[4];
-            stream.read(bytes, 4);
-            auto len = *reinterpret_cast<unsigned int*>(bytes);
-            ObjectRefMap objs;
-            for (auto i = 0u; i < len; ++i) {
-                auto key = deserialise_from_file(stream);
-                auto value = deserialise_from_file(stream);
-                objs[key] = value;
+            auto res = data.substr(0, len);
+            data.remove_prefix(len);
+            return res;
+        }
+    public:
+        static constexpr std::size_t max_reserve = static_cast<std::size_t>(-1);
+
+        MemorySource(std::string_view& data, const std::shared_ptr<const void>& owner) : data(data), owner(owner) {}
+        std::size_t remaining() const {
+            return data.size();
+        }
+        unsigned char peek() {
+            if (!data.size()) {
+                throw std::runtime_error("Unexpected end of serialised data");
             }
-            return create<Dict>(objs);
+            return static_cast<unsigned char>(data[0]);
         }
-        case SerialisationType::BYTES: {
-            char bytes[4];
-            stream.read(bytes, 4);
-            auto len = *reinterpret_cast<unsigned int*>(bytes);
-            auto str = std::basic_string<unsigned char>(len, '\0');
-            stream.read(reinterpret_cast<char*>(str.data()), len);
-            return create<Bytes>(str);
+        unsigned char byte() {
+            return static_cast<unsigned char>(take(1)[0]);
         }
-        case SerialisationType::TRUE: {
-            return Boolean::true_;
+        void read(char* dest, std::size_t len) {
+            std::memcpy(dest, take(len).data(), len);
         }
-        case SerialisationType::FALSE: {
-            return Boolean::false_;
+        ObjectRef string(std::size_t len) {
+            return create<String>(owner, take(len));
         }
-        case SerialisationType::NONE: {
-            return NoneType::none;
+        ObjectRef bytes(std::size_t len) {
+            auto str = take(len);
+            return create<Bytes>(owner, std::basic_string_view<unsigned char>(reinterpret_cast<const unsigned char*>(str.data()), str.size()));
         }
-        default: {
-            throw std::runtime_error("Unknown serialisation type" + std::to_string(static_cast<int>(type)));
+    };
+
+    template<class T, class Source> T read_raw(Source& source) {
+        T v;
+        source.read(reinterpret_cast<char*>(&v), sizeof(T));
+        return v;
+    }
+
+    template<class Source> uint64_t read_varint(Source& source) {
+        uint64_t v = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            auto byte = source.byte();
+            v |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return v;
+            }
+        }
+        throw std::runtime_error("Varint too long");
+    }
+
+    int64_t unzigzag(uint64_t v) {
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+    uint64_t zigzag(int64_t v) {
+        return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+    }
+
+    // A list or dict whose items are still being read
+    struct PendingContainer {
+        SerialisationType type;
+        uint64_t remaining;
+        std::vector<ObjectRef> items;
+        DictMap map;
+        ObjectRef key;
+    };
+
+    // Iterative, so deep nesting can't overflow the C++ stack
+    template<class Source> ObjectRef deserialise_body(Source& source, unsigned int version) {
+        std::vector<ObjectRef> strings;
+        std::vector<PendingContainer> stack;
+        auto length = [&]() -> uint64_t {
+            return version == 1 ? read_raw<uint32_t>(source) : read_varint(source);
+        };
+
+        while (true) {
+            ObjectRef obj;
+            auto type = static_cast<SerialisationType>(source.byte());
+            switch (type) {
+                case SerialisationType::INT: {
+                    obj = create<Integer>(version == 1 ? read_raw<int32_t>(source) : unzigzag(read_varint(source)));
+                    break;
+                }
+                case SerialisationType::FLOAT: {
+                    obj = create<Float>(read_raw<double>(source));
+                    break;
+                }
+                case SerialisationType::STRING: {
+                    obj = source.string(length());
+                    if (version != 1) {
+                        strings.push_back(obj);
+                    }
+                    break;
+                }
+                case SerialisationType::BYTES: {
+                    obj = source.bytes(length());
+                    break;
+                }
+                case SerialisationType::TRUE: {
+                    obj = Boolean::true_;
+                    break;
+                }
+                case SerialisationType::FALSE: {
+                    obj = Boolean::false_;
+                    break;
+                }
+                case SerialisationType::NONE: {
+                    obj = NoneType::none;
+                    break;
+                }
+                case SerialisationType::LIST:
+                case SerialisationType::SET:
+                case SerialisationType::DICT: {
+                    auto len = length();
+                    // Every item takes at least one byte, and a dict entry is two. Divided rather than multiplied, so
+                    // that a huge length can't overflow past the check.
+                    if (len > source.remaining() / (type == SerialisationType::DICT ? 2 : 1)) {
+                        throw std::runtime_error("Serialised length exceeds the data");
+                    }
+                    auto reserve = std::min<uint64_t>(len, Source::max_reserve);
+                    if (!len) {
+                        if (type == SerialisationType::LIST) {
+                            obj = create<List>(std::vector<ObjectRef>{});
+                        }
+                        else if (type == SerialisationType::SET) {
+                            obj = create<Set>(SetMap{});
+                        }
+                        else {
+                            obj = create<Dict>(DictMap{});
+                        }
+                        break;
+                    }
+                    stack.push_back({type, len, {}, {}, nullptr});
+                    if (type != SerialisationType::DICT) {
+                        stack.back().items.reserve(reserve);
+                    }
+                    continue;
+                }
+                default: {
+                    if (version != 1 && type == SerialisationType::STRING_REF) {
+                        auto index = read_varint(source);
+                        if (index >= strings.size()) {
+                            throw std::runtime_error("String reference out of range");
+                        }
+                        obj = strings[index];
+                        break;
+                    }
+                    throw std::runtime_error("Unknown serialisation type" + std::to_string(static_cast<int>(type)));
+                }
+            }
+
+            // Hand the finished object to its container, finishing containers in turn
+            while (true) {
+                if (!stack.size()) {
+                    return obj;
+                }
+                auto& top = stack.back();
+                if (top.type != SerialisationType::DICT) {
+                    top.items.push_back(std::move(obj));
+                }
+                else if (!top.key) {
+                    top.key = std::move(obj);
+                    break;
+                }
+                else {
+                    top.map.insert(top.key, obj);
+                    top.key = nullptr;
+                }
+                if (--top.remaining) {
+                    break;
+                }
+                if (top.type == SerialisationType::LIST) {
+                    obj = create<List>(std::move(top.items));
+                }
+                else if (top.type == SerialisationType::SET) {
+                    SetMap set;
+                    for (auto& item : top.items) {
+                        set.insert(item, {});
+                    }
+                    obj = create<Set>(std::move(set));
+                }
+                else {
+                    obj = create<Dict>(std::move(top.map));
+                }
+                stack.pop_back();
+            }
+        }
+    }
+
+    template<class Source> ObjectRef deserialise(Source& source) {
+        if (source.peek() != static_cast<unsigned char>(MAGIC[0])) {
+            // v1 has no header
+            return deserialise_body(source, 1);
+        }
+        char magic[sizeof(MAGIC)];
+        source.read(magic, sizeof(magic));
+        if (std::memcmp(magic, MAGIC, sizeof(magic))) {
+            throw std::runtime_error("Bad serialisation header");
+        }
+        auto version = read_varint(source);
+        if (version != 2) {
+            throw std::runtime_error("Unsupported serialisation version " + std::to_string(version));
+        }
+        return deserialise_body(source, 2);
+    }
+}
+
+ObjectRef deserialise_from_file(std::istream& stream) {
+    StreamSource source(stream);
+    return deserialise(source);
+}
+
+ObjectRef deserialise_from_memory(std::string_view& data, const std::shared_ptr<const void>& owner) {
+    MemorySource source(data, owner);
+    return deserialise(source);
+}
+
+Serialiser::Serialiser(unsigned int version) : version(version) {
+    if (version == 2) {
+        buffer.append(MAGIC, sizeof(MAGIC));
+        varint(version);
+    }
+    else if (version != 1) {
+        throw std::runtime_error("Unsupported serialisation version " + std::to_string(version));
+    }
+}
+
+void Serialiser::tag(char type) {
+    buffer.push_back(type);
+}
+
+void Serialiser::length(std::size_t len) {
+    if (version == 1) {
+        uint32_t v = len;
+        buffer.append(reinterpret_cast<const char*>(&v), 4);
+    }
+    else {
+        varint(len);
+    }
+}
+
+void Serialiser::varint(uint64_t v) {
+    while (v >= 0x80) {
+        buffer.push_back(static_cast<char>((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    buffer.push_back(static_cast<char>(v));
+}
+
+void Serialiser::write_int(int64_t v) {
+    tag(static_cast<char>(SerialisationType::INT));
+    if (version == 1) {
+        int32_t v32 = v;
+        buffer.append(reinterpret_cast<const char*>(&v32), 4);
+    }
+    else {
+        varint(zigzag(v));
+    }
+}
+
+void Serialiser::write_float(double v) {
+    tag(static_cast<char>(SerialisationType::FLOAT));
+    buffer.append(reinterpret_cast<const char*>(&v), 8);
+}
+
+void Serialiser::write_string(std::string_view str) {
+    if (version == 2) {
+        auto [iter, added] = strings.emplace(str, strings.size());
+        if (!added) {
+            tag(static_cast<char>(SerialisationType::STRING_REF));
+            varint(iter->second);
+            return;
         }
     }
+    tag(static_cast<char>(SerialisationType::STRING));
+    length(str.size());
+    buffer.append(str);
+}
+
+void Serialiser::write_bytes(std::basic_string_view<unsigned char> str) {
+    tag(static_cast<char>(SerialisationType::BYTES));
+    length(str.size());
+    buffer.append(reinterpret_cast<const char*>(str.data()), str.size());
 }
 
-void serialize_to_file(std::ostream& stream, ObjectRef obj) {
-    if (auto ptr = dynamic_cast<const Integer*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::INT);
-        auto v = ptr->get();
-        stream.write(reinterpret_cast<const char*>(&v), 4);
+void Serialiser::begin_list(std::size_t size) {
+    tag(static_cast<char>(SerialisationType::LIST));
+    length(size);
+}
+
+void Serialiser::begin_set(std::size_t size) {
+    tag(static_cast<char>(SerialisationType::SET));
+    length(size);
+}
+
+void Serialiser::begin_dict(std::size_t size) {
+    tag(static_cast<char>(SerialisationType::DICT));
+    length(size);
+}
+
+void Serialiser::write(const ObjectRef& obj) {
+    // Exact type comparisons first, they are much cheaper than a chain of dynamic_casts. Subclasses take the slow path.
+    auto type = obj->obj_type().get();
+    if (type == Integer::type.get()) {
+        write_int(static_cast<const Integer*>(obj.get())->get());
+    }
+    else if (type == String::type.get()) {
+        write_string(static_cast<const String*>(obj.get())->get());
+    }
+    else if (type == Float::type.get()) {
+        write_float(static_cast<const Float*>(obj.get())->get());
+    }
+    else if (type == Boolean::type.get()) {
+        tag(static_cast<char>(static_cast<const Boolean*>(obj.get())->get() ? SerialisationType::TRUE : SerialisationType::FALSE));
+    }
+    else if (type == NoneType::type.get()) {
+        tag(static_cast<char>(SerialisationType::NONE));
+    }
+    else if (type == List::type.get()) {
+        write_list(static_cast<const List*>(obj.get()));
+    }
+    else if (type == Dict::type.get()) {
+        write_dict(static_cast<const Dict*>(obj.get()));
+    }
+    else if (type == Bytes::type.get()) {
+        write_bytes(static_cast<const Bytes*>(obj.get())->get());
+    }
+    else if (type == Set::type.get()) {
+        write_set(static_cast<const Set*>(obj.get()));
+    }
+    else if (auto ptr = dynamic_cast<const Boolean*>(obj.get())) {
+        tag(static_cast<char>(ptr->get() ? SerialisationType::TRUE : SerialisationType::FALSE));
+    }
+    else if (auto ptr = dynamic_cast<const Integer*>(obj.get())) {
+        write_int(ptr->get());
     }
     else if (auto ptr = dynamic_cast<const Float*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::FLOAT);
-        auto v = ptr->get();
-        stream.write(reinterpret_cast<const char*>(&v), 8);
+        write_float(ptr->get());
     }
     else if (auto ptr = dynamic_cast<const String*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::STRING);
-        auto v = ptr->get().size();
-        stream.write(reinterpret_cast<const char*>(&v), 4);
-        stream << ptr->get();
+        write_string(ptr->get());
     }
     else if (auto ptr = dynamic_cast<const Bytes*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::BYTES);
-        auto v = ptr->get().size();
-        stream.write(reinterpret_cast<const char*>(&v), 4);
-        stream.write(reinterpret_cast<const char*>(ptr->get().data()), v);
+        write_bytes(ptr->get());
     }
     else if (auto ptr = dynamic_cast<const List*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::LIST);
-        auto v = ptr->get().size();
-        stream.write(reinterpret_cast<const char*>(&v), 4);
-        for (auto& item : ptr->get()) {
-            serialize_to_file(stream, item);
-        }
+        write_list(ptr);
     }
     else if (auto ptr = dynamic_cast<const Dict*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::DICT);
-        auto v = ptr->get().size();
-        stream.write(reinterpret_cast<const char*>(&v), 4);
-        for (auto& item : ptr->get()) {
-            serialize_to_file(stream, item.first);
-            serialize_to_file(stream, item.second);
-        }
+        write_dict(ptr);
     }
-    else if (auto ptr = dynamic_cast<const NoneType*>(obj.get())) {
-        stream << static_cast<char>(SerialisationType::NONE);
+    else if (auto ptr = dynamic_cast<const Set*>(obj.get())) {
+        write_set(ptr);
     }
-    else if (auto ptr = dynamic_cast<const Boolean*>(obj.get())) {
-        stream << static_cast<char>(ptr->get() ? SerialisationType::TRUE : SerialisationType::FALSE);
+    else if (dynamic_cast<const NoneType*>(obj.get())) {
+        tag(static_cast<char>(SerialisationType::NONE));
     }
     else {
         throw std::runtime_error("Unknown serialisation type");
     }
 }
+
+void Serialiser::write_list(const List* list) {
+    auto& storage = list->storage();
+    begin_list(list->size());
+    if (auto values = std::get_if<PVector<int64_t>>(&storage)) {
+        for (auto value : *values) {
+            write_int(value);
+        }
+    }
+    else if (auto values = std::get_if<PVector<double>>(&storage)) {
+        for (auto value : *values) {
+            write_float(value);
+        }
+    }
+    else if (auto values = std::get_if<PVector<uint8_t>>(&storage)) {
+        for (auto value : *values) {
+            tag(static_cast<char>(value ? SerialisationType::TRUE : SerialisationType::FALSE));
+        }
+    }
+    else {
+        for (auto& item : list->get()) {
+            write(item);
+        }
+    }
+}
+
+void Serialiser::write_dict(const Dict* dict) {
+    begin_dict(dict->get().size());
+    for (auto& item : dict->get()) {
+        write(item.first);
+        write(item.second);
+    }
+}
+
+void Serialiser::write_set(const Set* set) {
+    begin_set(set->get().size());
+    for (auto& item : set->get()) {
+        write(item.first);
+    }
+}
+
+void Serialiser::write_to(int fd) const {
+    auto data = buffer.data();
+    auto remaining = buffer.size();
+    while (remaining) {
+        auto n = ::write(fd, data, remaining);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Could not write serialised data");
+        }
+        data += n;
+        remaining -= n;
+    }
+}
+
+void serialize_to_file(std::ostream& stream, ObjectRef obj, unsigned int version) {
+    Serialiser serialiser(version);
+    serialiser.write(obj);
+    stream.write(serialiser.data().data(), serialiser.data().size());
+}
@@ -1,12 +1,50 @@
 #ifndef SERIALISATION_HPP
 #define SERIALISATION_HPP
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <unordered_map>
 
 #include "object.hpp"
 
+// Version written by default. Both versions are read, told apart by the v2 header.
+const unsigned int SERIALISATION_VERSION = 2;
+
 ObjectRef deserialise_from_file(std::istream& stream);
-void serialize_to_file(std::ostream& stream, ObjectRef obj);
+// Deserialises one object from the front of data and advances data past it. Strings and bytes are views into data,
+// which must be kept alive by owner.
+ObjectRef deserialise_from_memory(std::string_view& data, const std::shared_ptr<const void>& owner);
+void serialize_to_file(std::ostream& stream, ObjectRef obj, unsigned int version = SERIALISATION_VERSION);
+
+// Serialises into one contiguous buffer. Besides whole objects, lists, sets and dicts can be written piecewise with
+// begin_list/begin_set/begin_dict followed by exactly that many items (key and value for dicts).
+class Serialiser {
+    std::string buffer;
+    unsigned int version;
+    std::unordered_map<std::string, unsigned int> strings;
+
+    void tag(char type);
+    void length(std::size_t len);
+    void varint(uint64_t v);
+    void write_list(const List* list);
+    void write_dict(const Dict* dict);
+    void write_set(const Set* set);
+public:
+    Serialiser(unsigned int version = SERIALISATION_VERSION);
+    void write(const ObjectRef& obj);
+    void write_int(int64_t v);
+    void write_float(double v);
+    void write_string(std::string_view str);
+    void write_bytes(std::basic_string_view<unsigned char> str);
+    void begin_list(std::size_t size);
+    void begin_dict(std::size_t size);
+    void begin_set(std::size_t size);
+
+    const std::string& data() const { return buffer; }
+    // Writes the whole buffer with write(2)
+    void write_to(int fd) const;
+};
 
 #endif // SERIALISATION_HPP
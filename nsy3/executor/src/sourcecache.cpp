@@ -0,0 +1,55 @@
+#include "sourcecache.hpp"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <sys/stat.h>
+
+SourceFile::SourceFile(const std::string& fname) : file(fname) {
+    line_starts.push_back(0);
+    auto data = file.data(), end = file.data() + file.size();
+    while (auto newline = static_cast<const char*>(data == end ? nullptr : std::memchr(data, '\n', end - data))) {
+        data = newline + 1;
+        line_starts.push_back(data - file.data());
+    }
+}
+
+std::string_view SourceFile::line(int lineno) const {
+    if (lineno < 1 || static_cast<std::size_t>(lineno) > line_starts.size()) {
+        return {};
+    }
+    auto start = line_starts[lineno - 1];
+    auto end = static_cast<std::size_t>(lineno) < line_starts.size() ? line_starts[lineno] - 1 : file.size();
+    return file.view().substr(start, end - start);
+}
+
+namespace {
+    struct CachedSource {
+        std::shared_ptr<const SourceFile> source;
+        struct timespec mtime;
+        off_t size;
+    };
+
+    std::mutex cache_mutex;
+    std::map<std::string, CachedSource> cache;
+}
+
+std::shared_ptr<const SourceFile> source_file(const std::string& fname) {
+    struct stat st;
+    if (stat(fname.c_str(), &st)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto& cached = cache[fname];
+    if (!cached.source || cached.size != st.st_size || cached.mtime.tv_sec != st.st_mtim.tv_sec || cached.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        try {
+            cached = {std::make_shared<const SourceFile>(fname), st.st_mtim, st.st_size};
+        }
+        catch (const std::runtime_error&) {
+            cache.erase(fname);
+            return nullptr;
+        }
+    }
+    return cached.source;
+}
@@ -0,0 +1,24 @@
+#ifndef SOURCECACHE_HPP
+#define SOURCECACHE_HPP
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mappedfile.hpp"
+
+// A mapped source file with the offset of the start of every line
+class SourceFile {
+    MappedFile file;
+    std::vector<std::size_t> line_starts;
+public:
+    SourceFile(const std::string& fname);
+    // Line numbers start at 1. Out of range lines are empty.
+    std::string_view line(int lineno) const;
+};
+
+// Returns the cached source file, mapping it again if it has changed since. Returns null if it can't be read.
+std::shared_ptr<const SourceFile> source_file(const std::string& fname);
+
+#endif // SOURCECACHE_HPP
@@ -0,0 +1,220 @@
+#include "textmethods.hpp"
+#include "functionutils.hpp"
+#include "exception.hpp"
+#include "kernels.hpp"
+
+#include <type_traits>
+
+namespace {
+    template<typename S> using View = std::remove_cv_t<decltype(std::declval<const S&>().get())>;
+    template<typename S> using Char = typename View<S>::value_type;
+    template<typename S> using Str = std::basic_string<Char<S>>;
+
+    template<typename S> bool is_space(Char<S> c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    // Methods with optional arguments take them all as a vector, with self first
+    void check_args(const std::vector<ObjectRef>& args, std::size_t min, std::size_t max, const char* name) {
+        if (args.size() < min || args.size() > max) {
+            create<TypeError>(std::string(name) + " takes " + std::to_string(min - 1) + " to " + std::to_string(max - 1)
+                              + " arguments, got " + std::to_string(args.size() - 1))->raise();
+        }
+    }
+
+    template<typename S> std::shared_ptr<const S> text(const ObjectRef& obj) {
+        return convert<std::shared_ptr<const S>>(obj);
+    }
+
+    // Pieces share the buffer of the text being split
+    template<typename S> ObjectRef split(const std::vector<ObjectRef>& args) {
+        check_args(args, 1, 2, "split");
+        auto self = text<S>(args[0]);
+        auto value = self->get();
+        std::vector<ObjectRef> pieces;
+        if (args.size() == 1 || args[1] == NoneType::none) {
+            // Runs of whitespace separate the pieces, and there are no empty ones
+            for (std::size_t pos = 0;;) {
+                while (pos < value.size() && is_space<S>(value[pos])) {
+                    ++pos;
+                }
+                if (pos == value.size()) {
+                    break;
+                }
+                auto end = pos;
+                while (end < value.size() && !is_space<S>(value[end])) {
+                    ++end;
+                }
+                pieces.push_back(create<S>(self->rope().substr(pos, end - pos)));
+                pos = end;
+            }
+            return create<List>(std::move(pieces));
+        }
+        auto sep = text<S>(args[1])->get();
+        if (sep.empty()) {
+            create<ValueError>("Empty separator")->raise();
+        }
+        std::size_t pos = 0;
+        for (auto at = kernels::find(value, sep); at != value.npos; at = kernels::find(value, sep, pos)) {
+            pieces.push_back(create<S>(self->rope().substr(pos, at - pos)));
+            pos = at + sep.size();
+        }
+        pieces.push_back(create<S>(self->rope().substr(pos)));
+        return create<List>(std::move(pieces));
+    }
+
+    // Sizes everything up first, so the result is built in one allocation
+    template<typename S> ObjectRef join(const S* self, const List* items) {
+        auto sep = self->get();
+        std::vector<View<S>> values;
+        values.reserve(items->size());
+        std::size_t size = 0;
+        for (auto& item : items->get()) {
+            values.push_back(text<S>(item)->get());
+            size += values.back().size() + sep.size();
+        }
+        Str<S> res;
+        res.reserve(size);
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            if (i) {
+                res.append(sep);
+            }
+            res.append(values[i]);
+        }
+        return create<S>(std::move(res));
+    }
+
+    template<typename S> ObjectRef find(const std::vector<ObjectRef>& args) {
+        check_args(args, 2, 3, "find");
+        auto value = text<S>(args[0])->get();
+        // As in Python, a negative start counts from the end
+        int64_t start = args.size() > 2 ? convert<const Integer*>(args[2])->get() : 0;
+        start = std::max<int64_t>(0, start < 0 ? start + static_cast<int64_t>(value.size()) : start);
+        auto pos = kernels::find(value, text<S>(args[1])->get(), start);
+        return create<Integer>(pos == value.npos ? -1 : static_cast<int64_t>(pos));
+    }
+
+    template<typename S> ObjectRef replace(std::shared_ptr<const S> self, const S* old, const S* replacement) {
+        auto value = self->get(), from = old->get(), to = replacement->get();
+        if (from.empty()) {
+            create<ValueError>("Empty substring to replace")->raise();
+        }
+        auto at = kernels::find(value, from);
+        if (at == value.npos) {
+            return self;
+        }
+        Str<S> res;
+        res.reserve(value.size());
+        std::size_t pos = 0;
+        for (; at != value.npos; at = kernels::find(value, from, pos)) {
+            res.append(value.substr(pos, at - pos)).append(to);
+            pos = at + from.size();
+        }
+        res.append(value.substr(pos));
+        return create<S>(std::move(res));
+    }
+
+    // Without an argument strips whitespace, otherwise any of the given characters. The result shares the buffer.
+    template<typename S> ObjectRef strip(const std::vector<ObjectRef>& args) {
+        check_args(args, 1, 2, "strip");
+        auto self = text<S>(args[0]);
+        auto value = self->get();
+        auto chars = args.size() > 1 ? text<S>(args[1])->get() : View<S>();
+        auto stripped = [&](Char<S> c) {
+            return args.size() > 1 ? chars.find(c) != chars.npos : is_space<S>(c);
+        };
+        std::size_t start = 0, end = value.size();
+        while (start < end && stripped(value[start])) {
+            ++start;
+        }
+        while (end > start && stripped(value[end - 1])) {
+            --end;
+        }
+        return create<S>(self->rope().substr(start, end - start));
+    }
+
+    template<typename S> ObjectRef change_case(const S* self, bool upper) {
+        auto value = self->get();
+        Str<S> res(value.size(), '\0');
+        kernels::ascii_case(value.data(), res.data(), value.size(), upper);
+        return create<S>(std::move(res));
+    }
+
+    // Python style {} and {N} fields, with {{ and }} for braces. Arguments are converted with to_str.
+    ObjectRef format(const std::vector<ObjectRef>& args) {
+        check_args(args, 1, SIZE_MAX, "format");
+        auto value = text<String>(args[0])->get();
+        std::string res;
+        res.reserve(value.size());
+        std::size_t next_arg = 0;
+        for (std::size_t pos = 0; pos < value.size(); ++pos) {
+            auto c = value[pos];
+            if ((c == '{' || c == '}') && pos + 1 < value.size() && value[pos + 1] == c) {
+                res += c;
+                ++pos;
+                continue;
+            }
+            if (c == '}') {
+                create<ValueError>("Single '}' in format string")->raise();
+            }
+            if (c != '{') {
+                res += c;
+                continue;
+            }
+            auto close = value.find('}', pos);
+            if (close == value.npos) {
+                create<ValueError>("Single '{' in format string")->raise();
+            }
+            auto field = value.substr(pos + 1, close - pos - 1);
+            std::size_t index = next_arg++;
+            if (!field.empty()) {
+                if (field.size() > 9 || field.find_first_not_of("0123456789") != field.npos) {
+                    create<ValueError>("Unsupported format field '" + std::string(field) + "'")->raise();
+                }
+                index = std::stoul(std::string(field));
+            }
+            if (index + 1 >= args.size()) {
+                create<IndexError>("Format field " + std::to_string(index) + " is out of range for "
+                                   + std::to_string(args.size() - 1) + " arguments")->raise();
+            }
+            res += args[index + 1]->to_str();
+            pos = close;
+        }
+        return create<String>(std::move(res));
+    }
+}
+
+template<typename S> Type::attrmap with_text_methods(Type::attrmap attrs) {
+    attrs.insert({
+        {"split", create<BuiltinFunction>(split<S>)},
+        {"join", create<BuiltinFunction>([](const S* self, const List* items) {
+            return join(self, items);
+        })},
+        {"find", create<BuiltinFunction>(find<S>)},
+        {"startswith", create<BuiltinFunction>([](const S* self, const S* prefix) {
+            auto value = self->get(), part = prefix->get();
+            return value.substr(0, part.size()) == part;
+        })},
+        {"endswith", create<BuiltinFunction>([](const S* self, const S* suffix) {
+            auto value = self->get(), part = suffix->get();
+            return value.size() >= part.size() && value.substr(value.size() - part.size()) == part;
+        })},
+        {"replace", create<BuiltinFunction>([](std::shared_ptr<const S> self, const S* old, const S* replacement) {
+            return replace(std::move(self), old, replacement);
+        })},
+        {"strip", create<BuiltinFunction>(strip<S>)},
+        {"lower", create<BuiltinFunction>([](const S* self) {
+            return change_case(self, false);
+        })},
+        {"upper", create<BuiltinFunction>([](const S* self) {
+            return change_case(self, true);
+        })},
+    });
+    if constexpr (std::is_same_v<S, String>) {
+        attrs.insert({"format", create<BuiltinFunction>(format)});
+    }
+    return attrs;
+}
+
+template Type::attrmap with_text_methods<String>(Type::attrmap attrs);
+template Type::attrmap with_text_methods<Bytes>(Type::attrmap attrs);
@@ -0,0 +1,10 @@
+#ifndef TEXTMETHODS_HPP
+#define TEXTMETHODS_HPP
+
+#include "object.hpp"
+
+// Adds the methods shared by String and Bytes (split, join, find, startswith, endswith, replace, strip, lower, upper)
+// to attrs, plus format for String. Instantiated for String and Bytes.
+template<typename S> Type::attrmap with_text_methods(Type::attrmap attrs);
+
+#endif // TEXTMETHODS_HPP
@@ -0,0 +1,64 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+ThreadPool::ThreadPool(unsigned int threads) {
+    for (auto i = 0u; i < std::max(threads, 1u); ++i) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+unsigned int ThreadPool::default_threads() {
+    if (auto threads = std::getenv("NSY3_THREADS")) {
+        if (auto value = std::atoi(threads); value > 0) {
+            return value;
+        }
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+namespace {
+    std::mutex shared_mutex;
+    std::unique_ptr<ThreadPool> shared_pool;
+}
+
+ThreadPool& ThreadPool::shared() {
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    if (!shared_pool) {
+        shared_pool = std::make_unique<ThreadPool>();
+    }
+    return *shared_pool;
+}
+
+void ThreadPool::release_shared() {
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    shared_pool.reset();
+}
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
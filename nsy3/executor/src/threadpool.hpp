@@ -0,0 +1,51 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads running submitted tasks in order of submission. Destroying the pool runs the tasks
+// still queued and joins the workers, so a pool must not be alive across a fork.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    void work();
+public:
+    explicit ThreadPool(unsigned int threads = default_threads());
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // The NSY3_THREADS environment variable if set, otherwise one per hardware thread
+    static unsigned int default_threads();
+
+    // A pool of default_threads() kept between uses, made on first use. release_shared() destroys it, and has to be
+    // called before forking.
+    static ThreadPool& shared();
+    static void release_shared();
+
+    // Exceptions thrown by func are rethrown from the future's get()
+    template<typename F>
+    auto submit(F func) -> std::future<decltype(func())> {
+        auto task = std::make_shared<std::packaged_task<decltype(func())()>>(std::move(func));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([task]() { (*task)(); });
+        }
+        available.notify_one();
+        return future;
+    }
+};
+
+#endif // THREADPOOL_HPP
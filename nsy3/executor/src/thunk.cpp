@@ -3,7 +3,8 @@
 
 #include <iostream>
 
-Thunk::Thunk(ExecutionEngine* execengine) : execengine(execengine) {
+Thunk::Thunk(ExecutionEngine* execengine) : execengine(execengine), module_(execengine->executing_module()) {
+    serial_only();
 }
 
 Thunk::~Thunk() {
@@ -24,6 +25,10 @@ void Thunk::finalize(BaseObjectRef obj) const {
     execengine->finalize_thunk(std::dynamic_pointer_cast<const Thunk>(shared_from_this()), std::move(obj));
 }
 
+void Thunk::abandon() const {
+    const_cast<Thunk*>(this)->finalized = true;
+}
+
 std::string Thunk::to_str() const {
     return "T(?)";
 }
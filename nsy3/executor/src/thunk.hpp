@@ -10,6 +10,8 @@ class ExecutionEngine;
 
 class Thunk : public BaseObject {
     ExecutionEngine* execengine;
+    // Owned by the engine
+    const std::string* module_;
     bool finalized = false;
 public:
     Thunk(ExecutionEngine* execengine);
@@ -17,8 +19,12 @@ public:
     void subscribe(std::shared_ptr<const Thunk> thunk) const;
     virtual void notify(BaseObjectRef obj) const;
     void finalize(BaseObjectRef obj) const;
+    // Drops the thunk without a value, so that nothing subscribed to it is resumed
+    void abandon() const;
     virtual std::string to_str() const;
     ExecutionEngine* execution_engine() const { return execengine; }
+    // The module whose execution created this thunk
+    const std::string& module() const { return *module_; }
 };
 
 #endif // THUNK_HPP
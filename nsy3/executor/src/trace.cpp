@@ -0,0 +1,205 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace trace {
+
+// Level 1 events only carry names and numbers, so they are cheap enough to record on every run for the error dump
+unsigned char levels[static_cast<int>(Category::COUNT)] = {1, 1, 1, 1, 1};
+
+namespace {
+    const char* const CATEGORY_NAMES[static_cast<int>(Category::COUNT)] = {"dollar", "resolve", "notify", "reset", "exec"};
+
+    const char* const MESSAGES[static_cast<int>(Event::COUNT)] = {
+        "Making get for {}",
+        "Making set for {}",
+        "Alias {} = {}",
+        "Resolving {}",
+        "Done.",
+        "Finished!",
+        "{} = {}",
+        "Resolved in {} resets",
+        "Rerunning everything",
+        "Rerunning {}",
+        "Pruning {}",
+        "DN {}",
+        "$Exec {}",
+        "$Final {}",
+        "RML",
+        "RMLe",
+        "Dummy resolving {}",
+        "  notifying {}",
+        "Conflict: {} already set, but new set revealed by {}",
+        "Conflict: {} already (dummy) set, but new child {} revealed by {}",
+        "RESET!",
+        "Ordering now has {} items",
+        "    {}: {}",
+        "Executing {}",
+        "Initial execution done",
+        "Skip from {} to {}",
+        "Skip from {} to return",
+        "Resubscribe!"
+    };
+
+    enum : char { INT_ARG = 'i', STRING_ARG = 's' };
+
+    // Records are a u32 length followed by the event and its tagged arguments. The oldest records are overwritten
+    // once the buffer is full.
+    class RingBuffer {
+        std::vector<char> buffer = std::vector<char>(1 << 20);
+        std::size_t head = 0, used = 0;
+
+        void read(std::size_t pos, char* out, std::size_t len) const {
+            pos %= buffer.size();
+            auto first = std::min(len, buffer.size() - pos);
+            std::memcpy(out, buffer.data() + pos, first);
+            std::memcpy(out + first, buffer.data(), len - first);
+        }
+        void write(std::size_t pos, const char* in, std::size_t len) {
+            pos %= buffer.size();
+            auto first = std::min(len, buffer.size() - pos);
+            std::memcpy(buffer.data() + pos, in, first);
+            std::memcpy(buffer.data(), in + first, len - first);
+        }
+        uint32_t length_at(std::size_t pos) const {
+            uint32_t len;
+            read(pos, reinterpret_cast<char*>(&len), sizeof(len));
+            return len;
+        }
+    public:
+        void push(const std::string& record) {
+            auto needed = sizeof(uint32_t) + record.size();
+            if (needed > buffer.size()) {
+                return;
+            }
+            while (buffer.size() - used < needed) {
+                auto dropped = sizeof(uint32_t) + length_at(head);
+                head = (head + dropped) % buffer.size();
+                used -= dropped;
+            }
+            uint32_t len = record.size();
+            write(head + used, reinterpret_cast<const char*>(&len), sizeof(len));
+            write(head + used + sizeof(len), record.data(), record.size());
+            used += needed;
+        }
+        std::vector<std::string> records() const {
+            std::vector<std::string> res;
+            for (std::size_t pos = 0; pos < used;) {
+                std::string record(length_at(head + pos), '\0');
+                read(head + pos + sizeof(uint32_t), record.data(), record.size());
+                pos += sizeof(uint32_t) + record.size();
+                res.push_back(std::move(record));
+            }
+            return res;
+        }
+        void clear() {
+            head = used = 0;
+        }
+    };
+
+    std::mutex ring_mutex;
+    RingBuffer ring;
+
+    std::string format(const std::string& record) {
+        std::string res;
+        std::size_t pos = 1;
+        auto next_arg = [&]() -> std::string {
+            if (pos >= record.size()) {
+                return "?";
+            }
+            auto tag = record[pos++];
+            if (tag == INT_ARG) {
+                int64_t v;
+                std::memcpy(&v, record.data() + pos, sizeof(v));
+                pos += sizeof(v);
+                return std::to_string(v);
+            }
+            uint32_t len;
+            std::memcpy(&len, record.data() + pos, sizeof(len));
+            pos += sizeof(len);
+            pos += len;
+            return record.substr(pos - len, len);
+        };
+        for (auto message = MESSAGES[static_cast<unsigned char>(record[0])]; *message; ++message) {
+            if (message[0] == '{' && message[1] == '}') {
+                res += next_arg();
+                ++message;
+            }
+            else {
+                res += *message;
+            }
+        }
+        return res;
+    }
+}
+
+RecordWriter::~RecordWriter() {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    ring.push(data);
+}
+
+void RecordWriter::arg(int64_t v) {
+    data += INT_ARG;
+    data.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void RecordWriter::arg(std::string_view v) {
+    uint32_t len = v.size();
+    data += STRING_ARG;
+    data.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    data.append(v);
+}
+
+void RecordWriter::arg(const std::vector<std::string>& name) {
+    std::string dotted;
+    for (auto iter = name.begin(); iter != name.end(); ++iter) {
+        dotted += (iter == name.begin() ? "" : ".") + *iter;
+    }
+    arg(std::string_view(dotted));
+}
+
+void configure(const std::string& spec) {
+    std::size_t start = 0;
+    while (start <= spec.size()) {
+        auto end = std::min(spec.find(',', start), spec.size());
+        auto item = spec.substr(start, end - start);
+        auto colon = item.find(':');
+        auto name = colon == std::string::npos ? "all" : item.substr(0, colon);
+        auto level_text = colon == std::string::npos ? item : item.substr(colon + 1);
+        auto level = level_text.size() == 1 ? level_text[0] - '0' : -1;
+        if (level < 0 || level > static_cast<int>(MAX_LEVEL)) {
+            throw std::runtime_error("Trace level must be from 0 to " + std::to_string(MAX_LEVEL) + ", got '" + level_text + "'");
+        }
+        bool found = false;
+        for (auto i = 0; i < static_cast<int>(Category::COUNT); ++i) {
+            if (name == "all" || name == CATEGORY_NAMES[i]) {
+                levels[i] = level;
+                found = true;
+            }
+        }
+        if (!found) {
+            throw std::runtime_error("Unknown trace category " + name);
+        }
+        start = end + 1;
+    }
+}
+
+void dump(std::ostream& stream, std::size_t max_records) {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    auto records = ring.records();
+    for (auto i = records.size() - std::min(records.size(), max_records); i < records.size(); ++i) {
+        stream << format(records[i]) << "\n";
+    }
+    stream.flush();
+}
+
+void clear() {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    ring.clear();
+}
+
+}
@@ -0,0 +1,131 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Tracing of the engine's progress. Records are kept in binary form in a ring buffer and only formatted into
+// messages when dumped, which happens on request (--trace) or when execution fails. Every category records level 1
+// unless configured otherwise; events whose arguments are costly to record are level 2. Building without NSY3_TRACE
+// compiles every TRACE out, and its arguments are never evaluated.
+//
+//     TRACE(RESOLVE, 1, RESOLVING, name);
+//
+// records a RESOLVING event with the argument name if the RESOLVE category's level is at least 1.
+namespace trace {
+
+enum class Category : unsigned char {
+    DOLLAR,
+    RESOLVE,
+    NOTIFY,
+    RESET,
+    EXEC,
+    COUNT
+};
+
+// Each event has a message in trace.cpp, with {} replaced by its arguments in order
+enum class Event : unsigned char {
+    MAKING_GET,
+    MAKING_SET,
+    ALIAS,
+    RESOLVING,
+    DONE,
+    FINISHED,
+    VALUE,
+    RESOLVED_IN,
+    RERUNNING_EVERYTHING,
+    RERUNNING,
+    PRUNING,
+    DUMMY_NAME,
+    EXEC_THUNK,
+    FINAL_THUNK,
+    RML,
+    RMLE,
+    DUMMY_RESOLVING,
+    NOTIFYING,
+    CONFLICT,
+    CONFLICT_DUMMY,
+    RESET,
+    ORDERING_SIZE,
+    ORDERING_ITEM,
+    EXECUTING,
+    INITIAL_EXECUTION_DONE,
+    SKIP,
+    SKIP_TO_RETURN,
+    RESUBSCRIBE,
+    COUNT
+};
+
+constexpr unsigned int MAX_LEVEL = 2;
+
+extern unsigned char levels[static_cast<int>(Category::COUNT)];
+
+inline bool enabled(Category category, unsigned int level) {
+    return levels[static_cast<int>(category)] >= level;
+}
+
+// Sets levels from "<level>" for every category, or a comma separated list of "<category>:<level>", where the
+// category may be "all". Levels go from 0 (off) to MAX_LEVEL.
+void configure(const std::string& spec);
+
+// Writes the formatted messages of the last max_records records, oldest first
+void dump(std::ostream& stream, std::size_t max_records = -1);
+void clear();
+
+class RecordWriter {
+    std::string data;
+public:
+    explicit RecordWriter(Event event) : data(1, static_cast<char>(event)) {}
+    ~RecordWriter();
+
+    void arg(int64_t v);
+    void arg(std::string_view v);
+    // Dollar names, written dotted
+    void arg(const std::vector<std::string>& name);
+    template<typename T>
+    void arg(const T& v) {
+        if constexpr (std::is_integral_v<T>) {
+            arg(static_cast<int64_t>(v));
+        }
+        else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            arg(std::string_view(v));
+        }
+        else {
+            std::ostringstream ss;
+            ss << v;
+            arg(std::string_view(ss.str()));
+        }
+    }
+};
+
+template<typename... Args>
+void record(Event event, const Args&... args) {
+    RecordWriter writer(event);
+    (writer.arg(args), ...);
+}
+
+}
+
+#ifdef NSY3_TRACE
+#define TRACE(category, level, ...) \
+    do { \
+        if (trace::enabled(trace::Category::category, level)) { \
+            trace::record(trace::Event::__VA_ARGS__); \
+        } \
+    } while (0)
+#else
+// Still type checked, but never evaluated
+#define TRACE(category, level, ...) \
+    do { \
+        if (false) { \
+            trace::record(trace::Event::__VA_ARGS__); \
+        } \
+    } while (0)
+#endif
+
+#endif // TRACE_HPP
@@ -204,7 +204,7 @@ class NSY2Parser(Parser):
         ("left", OR),
         ("left", AND),
         ("right", NOT),
-        ("nonassoc", LTE, GTE, LT, GT, EQEQ, NEQ),
+        ("nonassoc", LTE, GTE, LT, GT, EQEQ, NEQ, IN),
         ("left", COLONPLUS),
         ("left", PLUS, MINUS),
         ("left", STAR, SLASH, SLASHSLASH, PERCENT),
@@ -406,6 +406,7 @@ class NSY2Parser(Parser):
         "expr GT expr",
         "expr EQEQ expr",
         "expr NEQ expr",
+        "expr IN expr",
 
         # Logs
         "expr AND expr",
@@ -1,12 +1,26 @@
 import enum
+import mmap
 import struct
 
 
 class Type(enum.Enum):
-    int, float, string, dict, set, list, bytes, true, false, none = range(10)
+    int, float, string, dict, set, list, bytes, true, false, none, string_ref = range(11)
 
 
-def serialise(obj):
+# v2 data starts with MAGIC followed by the version as a varint. No v1 type tag is a letter.
+MAGIC = b"NSY"
+VERSION = 2
+
+
+def serialise(obj, version=1):
+    if version == 1:
+        return _serialise_v1(obj)
+    elif version == 2:
+        return MAGIC + _varint(version) + _serialise_v2(obj, {})
+    raise RuntimeError(f"Unsupported serialisation version {version}")
+
+
+def _serialise_v1(obj):
     if isinstance(obj, int):
         return struct.pack("<Bi", Type.int.value, obj)
     elif isinstance(obj, float):
@@ -14,11 +28,11 @@ def serialise(obj):
     elif isinstance(obj, str):
         return struct.pack("<BI", Type.string.value, len(obj)) + obj.encode()
     elif isinstance(obj, dict):
-        return struct.pack("<BI", Type.dict.value, len(obj)) + b"".join(serialise(k) + serialise(v) for k, v in obj.items())
+        return struct.pack("<BI", Type.dict.value, len(obj)) + b"".join(_serialise_v1(k) + _serialise_v1(v) for k, v in obj.items())
     elif isinstance(obj, set):
-        return struct.pack("<BI", Type.set.value, len(obj)) + b"".join(serialise(x) for x in obj)
+        return struct.pack("<BI", Type.set.value, len(obj)) + b"".join(_serialise_v1(x) for x in obj)
     elif isinstance(obj, list):
-        return struct.pack("<BI", Type.list.value, len(obj)) + b"".join(serialise(x) for x in obj)
+        return struct.pack("<BI", Type.list.value, len(obj)) + b"".join(_serialise_v1(x) for x in obj)
     elif isinstance(obj, bytes):
         return struct.pack("<BI", Type.bytes.value, len(obj)) + obj
     elif obj is True:
@@ -31,7 +45,146 @@ def serialise(obj):
         raise RuntimeError(f"Can't serialise {type(obj)}")
 
 
+def _varint(v):
+    res = bytearray()
+    while v >= 0x80:
+        res.append((v & 0x7f) | 0x80)
+        v >>= 7
+    res.append(v)
+    return bytes(res)
+
+
+def _zigzag(v):
+    if not -2**63 <= v < 2**63:
+        raise RuntimeError(f"Integer {v} does not fit in 64 bits")
+    return (v << 1) ^ (v >> 63)
+
+
+def _serialise_v2(obj, strings):
+    # strings maps each string already written to its index, later occurrences are written as references
+    if obj is True:
+        return bytes([Type.true.value])
+    elif obj is False:
+        return bytes([Type.false.value])
+    elif obj is None:
+        return bytes([Type.none.value])
+    elif isinstance(obj, int):
+        return bytes([Type.int.value]) + _varint(_zigzag(obj))
+    elif isinstance(obj, float):
+        return struct.pack("<Bd", Type.float.value, obj)
+    elif isinstance(obj, str):
+        if obj in strings:
+            return bytes([Type.string_ref.value]) + _varint(strings[obj])
+        strings[obj] = len(strings)
+        encoded = obj.encode()
+        return bytes([Type.string.value]) + _varint(len(encoded)) + encoded
+    elif isinstance(obj, dict):
+        return bytes([Type.dict.value]) + _varint(len(obj)) + b"".join(_serialise_v2(k, strings) + _serialise_v2(v, strings) for k, v in obj.items())
+    elif isinstance(obj, set):
+        return bytes([Type.set.value]) + _varint(len(obj)) + b"".join(_serialise_v2(x, strings) for x in obj)
+    elif isinstance(obj, list):
+        return bytes([Type.list.value]) + _varint(len(obj)) + b"".join(_serialise_v2(x, strings) for x in obj)
+    elif isinstance(obj, bytes):
+        return bytes([Type.bytes.value]) + _varint(len(obj)) + obj
+    else:
+        raise RuntimeError(f"Can't serialise {type(obj)}")
+
+
 def deserialise(bytes, pos=0):
+    if bytes[pos:pos + len(MAGIC)] == MAGIC:
+        reader = _BytesReader(bytes, pos + len(MAGIC))
+        _check_version(reader)
+        obj = _deserialise_v2(reader, [])
+        return obj, reader.pos
+    return _deserialise_v1(bytes, pos)
+
+
+def deserialise_from_file(f):
+    tag = f.read(1)
+    if not tag:
+        raise EOFError("Unexpected end of file")
+    if tag == MAGIC[:1]:
+        reader = _FileReader(f)
+        if reader.read(len(MAGIC) - 1) != MAGIC[1:]:
+            raise RuntimeError("Bad serialisation header")
+        _check_version(reader)
+        return _deserialise_v2(reader, [])
+    return _deserialise_v1_from_file(f, tag[0])
+
+
+class _BytesReader:
+    def __init__(self, bytes, pos):
+        self.bytes = bytes
+        self.pos = pos
+
+    def read(self, n):
+        if self.pos + n > len(self.bytes):
+            raise EOFError("Unexpected end of data")
+        res = self.bytes[self.pos:self.pos + n]
+        self.pos += n
+        return res
+
+
+class _FileReader:
+    def __init__(self, f):
+        self.f = f
+
+    def read(self, n):
+        res = self.f.read(n)
+        if len(res) < n:
+            raise EOFError("Unexpected end of file")
+        return res
+
+
+def _read_varint(reader):
+    v = shift = 0
+    while True:
+        byte = reader.read(1)[0]
+        v |= (byte & 0x7f) << shift
+        if not byte & 0x80:
+            return v
+        shift += 7
+
+
+def _check_version(reader):
+    version = _read_varint(reader)
+    if version != VERSION:
+        raise RuntimeError(f"Unsupported serialisation version {version}")
+
+
+def _deserialise_v2(reader, strings):
+    type = Type(reader.read(1)[0])
+    if type is Type.int:
+        v = _read_varint(reader)
+        return (v >> 1) ^ -(v & 1)
+    elif type is Type.float:
+        return struct.unpack("<d", reader.read(8))[0]
+    elif type is Type.string:
+        strings.append(bytes(reader.read(_read_varint(reader))).decode())
+        return strings[-1]
+    elif type is Type.string_ref:
+        return strings[_read_varint(reader)]
+    elif type is Type.dict:
+        obj = {}
+        for _ in range(_read_varint(reader)):
+            k = _deserialise_v2(reader, strings)
+            obj[k] = _deserialise_v2(reader, strings)
+        return obj
+    elif type is Type.set:
+        return {_deserialise_v2(reader, strings) for _ in range(_read_varint(reader))}
+    elif type is Type.list:
+        return [_deserialise_v2(reader, strings) for _ in range(_read_varint(reader))]
+    elif type is Type.bytes:
+        return bytes(reader.read(_read_varint(reader)))
+    elif type is Type.true:
+        return True
+    elif type is Type.false:
+        return False
+    elif type is Type.none:
+        return None
+
+
+def _deserialise_v1(bytes, pos):
     type = Type(bytes[pos])
     if type is Type.int:
         return struct.unpack_from("<i", bytes, pos + 1)[0], pos + 5
@@ -44,22 +197,22 @@ def deserialise(bytes, pos=0):
         len, = struct.unpack_from("<I", bytes, pos + 1)
         obj, pos = {}, pos + 5
         for _ in range(len):
-            k, pos = deserialise(bytes, pos)
-            v, pos = deserialise(bytes, pos)
+            k, pos = _deserialise_v1(bytes, pos)
+            v, pos = _deserialise_v1(bytes, pos)
             obj[k] = v
         return obj, pos
     elif type is Type.set:
         len, = struct.unpack_from("<I", bytes, pos + 1)
         obj, pos = set(), pos + 5
         for _ in range(len):
-            x, pos = deserialise(bytes, pos)
+            x, pos = _deserialise_v1(bytes, pos)
             obj.add(x)
         return obj, pos
     elif type is Type.list:
         len, = struct.unpack_from("<I", bytes, pos + 1)
         obj, pos = [], pos + 5
         for _ in range(len):
-            x, pos = deserialise(bytes, pos)
+            x, pos = _deserialise_v1(bytes, pos)
             obj.append(x)
         return obj, pos
     elif type is Type.bytes:
@@ -73,8 +226,8 @@ def deserialise(bytes, pos=0):
         return None, pos + 1
 
 
-def deserialise_from_file(f):
-    type = Type(f.read(1)[0])
+def _deserialise_v1_from_file(f, tag):
+    type = Type(tag)
     if type is Type.int:
         return struct.unpack("<i", f.read(4))[0]
     elif type is Type.float:
@@ -86,22 +239,22 @@ def deserialise_from_file(f):
         len, = struct.unpack("<I", f.read(4))
         obj = {}
         for _ in range(len):
-            k = deserialise_from_file(f)
-            v = deserialise_from_file(f)
+            k = _deserialise_v1_from_file(f, f.read(1)[0])
+            v = _deserialise_v1_from_file(f, f.read(1)[0])
             obj[k] = v
         return obj
     elif type is Type.set:
         len, = struct.unpack("<I", f.read(4))
         obj = set()
         for _ in range(len):
-            x = deserialise_from_file(f)
+            x = _deserialise_v1_from_file(f, f.read(1)[0])
             obj.add(x)
         return obj
     elif type is Type.list:
         len, = struct.unpack("<I", f.read(4))
         obj = []
         for _ in range(len):
-            x = deserialise_from_file(f)
+            x = _deserialise_v1_from_file(f, f.read(1)[0])
             obj.append(x)
         return obj
     elif type is Type.bytes:
@@ -113,3 +266,85 @@ def deserialise_from_file(f):
         return False
     elif type is Type.none:
         return None
+
+
+def iter_records(f):
+    # Records written by `executor runspec --stream`: ["value", name, value] as soon as a value is resolved, ["reset"]
+    # when everything so far is invalidated, and ["done"] at the end
+    while True:
+        record = deserialise_from_file(f)
+        yield record
+        if record[0] == "done":
+            return
+
+
+def read_stream(f):
+    values = {}
+    for record in iter_records(f):
+        if record[0] == "value":
+            values[record[1]] = record[2]
+        elif record[0] == "reset":
+            values.clear()
+    return values
+
+
+class ResultStore:
+    # Reader for the indexed result store written by `executor runspec --store`, see resultstore.hpp for the layout
+    MAGIC = b"NSY3STOR"
+    VERSION = 1
+
+    def __init__(self, fname):
+        with open(fname, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.map[:8] != self.MAGIC:
+            raise RuntimeError(f"{fname} is not a result store")
+        version, self.count = struct.unpack_from("<II", self.map, 8)
+        if version != self.VERSION:
+            raise RuntimeError(f"{fname} has an unsupported result store version")
+
+    def _entry(self, i):
+        return struct.unpack_from("<IIII", self.map, 16 + 16 * i)
+
+    def _key(self, i):
+        key_off, key_len, _, _ = self._entry(i)
+        return self.map[key_off:key_off + key_len]
+
+    def _find(self, name):
+        key = name.encode()
+        lo, hi = 0, self.count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._key(mid) < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self.count and self._key(lo) == key:
+            return lo
+        return None
+
+    def __len__(self):
+        return self.count
+
+    def __contains__(self, name):
+        return self._find(name) is not None
+
+    def __getitem__(self, name):
+        i = self._find(name)
+        if i is None:
+            raise KeyError(name)
+        _, _, val_off, val_len = self._entry(i)
+        obj, pos = deserialise(self.map, val_off)
+        assert pos == val_off + val_len
+        return obj
+
+    def keys(self):
+        return [self._key(i).decode() for i in range(self.count)]
+
+    def close(self):
+        self.map.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
@@ -21,6 +21,8 @@ REMOVES = {
     Bytecode.ROT: lambda code: code.arg_v,
     Bytecode.RROT: lambda code: code.arg_v,
     Bytecode.BUILDLIST: lambda code: code.arg_v,
+    Bytecode.BUILDDICT: lambda code: 2 * code.arg_v,
+    Bytecode.FOR_ITER: lambda code: 1,
     Bytecode.UNPACK: lambda code: 1,
     Bytecode.LABEL: lambda code: 0,
     Bytecode.LINENO: lambda code: 0,
@@ -46,13 +48,20 @@ ADDS = {
     Bytecode.ROT: lambda code: code.arg_v,
     Bytecode.RROT: lambda code: code.arg_v,
     Bytecode.BUILDLIST: lambda code: 1,
+    Bytecode.BUILDDICT: lambda code: 1,
+    Bytecode.FOR_ITER: lambda code: 1,
     Bytecode.UNPACK: lambda code: code.arg_v.a,
     Bytecode.LABEL: lambda code: 0,
     Bytecode.LINENO: lambda code: 0,
     Bytecode.IGNORE: lambda code: 0,
 }
 
-SKIP_NOT_REQUIRED = {Bytecode.CONST, Bytecode.GETENV, Bytecode.BUILDLIST, Bytecode.UNPACK, Bytecode.ROT, Bytecode.RROT, Bytecode.DUP, Bytecode.JUMP_IF_KEEP, Bytecode.JUMP_IFNOT_KEEP}
+# What is pushed instead of ADDS when the jump is taken
+JUMP_ADDS = {
+    Bytecode.FOR_ITER: lambda code: 2,
+}
+
+SKIP_NOT_REQUIRED = {Bytecode.CONST, Bytecode.GETENV, Bytecode.BUILDLIST, Bytecode.BUILDDICT, Bytecode.FOR_ITER, Bytecode.UNPACK, Bytecode.ROT, Bytecode.RROT, Bytecode.DUP, Bytecode.JUMP_IF_KEEP, Bytecode.JUMP_IFNOT_KEEP}
 
 # Essence of this algorithm: (good luck!)
 #   We want to find, for each instruction, the nearest (in the graph sense) instruction that is:
@@ -73,7 +82,7 @@ def get_control_flow_graph(lin_code):
     for pos, code in enumerate(lin_code):
         if code.type is Bytecode.JUMP:
             next_nodes.append([lin_code.index(code.arg_v)])
-        elif code.type in (Bytecode.JUMP_IF, Bytecode.JUMP_IFNOT, Bytecode.JUMP_IF_KEEP, Bytecode.JUMP_IFNOT_KEEP):
+        elif code.type in (Bytecode.JUMP_IF, Bytecode.JUMP_IFNOT, Bytecode.JUMP_IF_KEEP, Bytecode.JUMP_IFNOT_KEEP, Bytecode.FOR_ITER):
             next_nodes.append([pos+1, lin_code.index(code.arg_v)])
         elif code.type is Bytecode.RETURN:
             next_nodes.append([None])
@@ -101,13 +110,15 @@ def get_possible_stacks_and_args(lin_code, control_flow_graph):
         add = ADDS[code.type](code)
         possible_args[pos].add(stack[-remove:] if remove else ())
         new_stack = (stack[:-remove] if remove else stack) + (pos,) * add
+        jump_stack = (stack[:-remove] if remove else stack) + (pos,) * JUMP_ADDS[code.type](code) if code.type in JUMP_ADDS else new_stack
 
         if len(stack) < remove:
             raise RuntimeError("Not enough on the stack")
 
-        for next_node in control_flow_graph[pos]:
+        for i, next_node in enumerate(control_flow_graph[pos]):
             if next_node is not None:
-                todo.append((next_node, new_stack))
+                # The jump target, if any, is the second successor
+                todo.append((next_node, jump_stack if i == 1 else new_stack))
 
     return possible_stacks, possible_args
 
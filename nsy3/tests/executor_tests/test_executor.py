@@ -1,14 +1,295 @@
 import pathlib
 import pytest
 import re
+import struct
+import subprocess
 
-from nsy3 import execution
+from nsy3 import execution, serialisation
 
 DIR = pathlib.Path(__file__).parent
 FILES = DIR.glob("*.nsy3")
 
-@pytest.mark.parametrize("file", [pytest.param(x, id=x.name) for x in FILES])
-def test_file(file):
+
+def run_assertions(file):
+    """Runs file, checks that as many assertions passed as it announced, and returns its output"""
     out = execution.Runspec([DIR]).add_fname(file).execute(return_stdout=True).decode()
     num_assertions = int(re.search(r"Assertions: (\d+)", out).group(1))
     assert num_assertions == out.count("Assertion passed")
+    return out
+
+
+@pytest.mark.parametrize("file", [pytest.param(x, id=x.name) for x in FILES])
+def test_file(file):
+    run_assertions(file)
+
+
+def test_matrix():
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "variants" / "base.nsy3")
+    for i in range(4):
+        runspec.add_variant(f"v{i}", {"scale": i, "offset": 5} if i % 2 else {"scale": i})
+    results = runspec.execute(return_dvs=True, jobs=2)
+    offsets = [5 if i % 2 else 0 for i in range(4)]
+    assert results == {f"v{i}": {"scale": i, "offset": offsets[i], "out": i * 10 + offsets[i]} for i in range(4)}
+
+
+def test_matrix_large_output():
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "variants" / "large.nsy3")
+    for i in range(4):
+        runspec.add_variant(f"v{i}", {"scale": i})
+    results = runspec.execute(return_dvs=True, jobs=3)
+    assert results == {f"v{i}": {"scale": i, "big": [x * i for x in range(20000)]} for i in range(4)}
+
+
+def test_matrix_bad_jobs():
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "variants" / "base.nsy3").add_variant("v", {"scale": 2})
+    for jobs in (0, -3):
+        with pytest.raises(RuntimeError):
+            runspec.execute(return_dvs=True, jobs=jobs)
+
+
+def test_demand():
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "demand" / "base.nsy3")
+    assert runspec.set_outputs(["d"]).execute(return_dvs=True) == {"d.x": 1, "d.y": 2}
+    assert runspec.set_outputs(["e", "b"]).execute(return_dvs=True) == {"b": 2, "e": 6}
+    runspec.set_conclusion("x = $c$\n")
+    assert runspec.set_outputs("conclusion").execute(return_dvs=True) == {"c": 5}
+
+
+def test_large_ints(tmp_path):
+    (tmp_path / "big.nsy3").write_text("$big$ = 1000000 * 1000000\n$neg$ = 0 - $big$\n")
+    runspec = execution.Runspec([tmp_path]).add_fname(tmp_path / "big.nsy3")
+    assert runspec.execute(return_dvs=True) == {"big": 10**12, "neg": -10**12}
+
+
+def tmp_runspec(tmp_path, programs):
+    """Writes programs, a dict of module name to source, into tmp_path and returns a Runspec of all of them"""
+    runspec = execution.Runspec([tmp_path])
+    for name, source in programs.items():
+        (tmp_path / f"{name}.nsy3").write_text(source)
+        runspec.add_fname(tmp_path / f"{name}.nsy3")
+    return runspec
+
+
+def test_sets(tmp_path):
+    runspec = tmp_runspec(tmp_path, {"s": '$s$ = {1, 2, "x"}\n$t$ = $given$.union({3})\n$empty$ = Set()\n'})
+    expected = {"s": {1, 2, "x"}, "given": {1, 2}, "t": {1, 2, 3}, "empty": set()}
+    assert runspec.add_variant("v", {"given": {1, 2}}).execute(return_dvs=True) == {"v": expected}
+
+
+def test_typed_lists(tmp_path):
+    runspec = tmp_runspec(tmp_path, {
+        "l": '$ints$ = $given$ :+ 4\n$floats$ = [0.5, 1.5]\n$flags$ = [TRUE, FALSE]\n$mixed$ = $ints$ :+ "x"\n'
+    })
+    expected = {
+        "given": [1, 2, 3], "ints": [1, 2, 3, 4], "floats": [0.5, 1.5], "flags": [True, False],
+        "mixed": [1, 2, 3, 4, "x"]
+    }
+    assert runspec.add_variant("v", {"given": [1, 2, 3]}).execute(return_dvs=True) == {"v": expected}
+
+
+def test_bytes_methods(tmp_path):
+    runspec = tmp_runspec(tmp_path, {
+        "b": "$parts$ = $given$.split($sep$)\n"
+             "$joined$ = $sep$.join($parts$).strip().upper()\n"
+             "$at$ = $given$.find($sep$)\n"
+    })
+    given = {"given": b" a,b ,c", "sep": b","}
+    expected = {**given, "parts": [b" a", b"b ", b"c"], "joined": b"A,B ,C", "at": 2}
+    assert runspec.add_variant("v", given).execute(return_dvs=True) == {"v": expected}
+
+
+def test_bulk_builtins_wait_on_thunks(tmp_path):
+    runspec = tmp_runspec(tmp_path, {
+        "a": "def scale(x):\n    return x * $factor$\n"
+             "def big(x):\n    return x > $factor$\n"
+             "$scaled$ = map(scale, [1, 2, 3])\n"
+             "$big$ = filter(big, Range(8, 13))\n",
+        "b": "$factor$ = 10\n"
+    })
+    assert runspec.execute(return_dvs=True) == {"factor": 10, "scaled": [10, 20, 30], "big": [11, 12]}
+
+
+def test_pmap_falls_back_for_dollars(tmp_path):
+    runspec = tmp_runspec(tmp_path, {
+        "a": "def scale(x):\n    return x * $factor$\n"
+             "def square(x):\n    return x * x\n"
+             "$scaled$ = pmap(scale, [1, 2, 3])\n"
+             "$squares$ = pmap(square, Range(0, 5))\n",
+        "b": "$factor$ = 10\n"
+    })
+    assert runspec.execute(return_dvs=True) == {"factor": 10, "scaled": [10, 20, 30], "squares": [0, 1, 4, 9, 16]}
+
+
+def test_pmap_threads(monkeypatch):
+    # Several workers whatever the machine has
+    monkeypatch.setenv("NSY3_THREADS", "4")
+    out = run_assertions(DIR / "pmap" / "threads.nsy3")
+    assert out.count(" -> 99 ") == 1
+
+
+def test_deserialise_limits():
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "demand" / "base.nsy3")
+    files = [str(f) for f in runspec.compiled_files]
+    data = serialisation.serialise({"files": files, "modules": runspec.modules, "conclusion": None})
+    count, = struct.unpack_from("<I", data, 1)
+    depth = 200000
+    deep = serialisation.serialise("deep") + b"\x05\x01\x00\x00\x00" * depth + b"\x09"
+    deep_runspec = data[:1] + struct.pack("<I", count + 1) + data[5:] + deep
+    proc = subprocess.run([execution.EXECUTOR, "runspec", "-"], input=deep_runspec, stdout=subprocess.PIPE)
+    assert proc.returncode == 0
+    assert execution.Runspec.extract_dvs(proc.stdout)["b"] == 2
+
+    # A dict length whose doubling overflows
+    huge_dict = serialisation.serialise({}, serialisation.VERSION)[:-1] + b"\x80" * 9 + b"\x01" + b"\x00" * 8
+    for bad in (data[:-3], data[:1] + b"\xff\xff\xff\x7f" + data[5:], huge_dict):
+        assert subprocess.run([execution.EXECUTOR, "runspec", "-"], input=bad, stdout=subprocess.PIPE).returncode == 1
+
+
+def corrupt(compiled):
+    # Appends a CONST whose index is out of range
+    data = compiled.read_bytes()
+    header, pos = serialisation.deserialise(data)
+    body, _ = serialisation.deserialise(data, pos)
+    body["code"] = body["code"] + bytes([6]) + struct.pack("<I", len(body["consts"]))
+    compiled.write_bytes(data[:pos] + serialisation.serialise(body, serialisation.VERSION))
+
+
+def test_invalid_code(tmp_path):
+    (tmp_path / "a.nsy3").write_text("$a$ = 1\n")
+    (tmp_path / "b.nsy3").write_text("$b$ = 2\n")
+    runspec = execution.Runspec([tmp_path]).add_fname(tmp_path / "a.nsy3").add_fname(tmp_path / "b.nsy3")
+    assert runspec.execute(return_dvs=True) == {"a": 1, "b": 2}
+
+    corrupt(runspec.compiled_files[1])
+    with pytest.raises(RuntimeError):
+        runspec.execute()
+
+
+def test_traceback(tmp_path):
+    (tmp_path / "a.nsy3").write_text("x = 1\n\ny = x + missing\n")
+    runspec = execution.Runspec([tmp_path]).add_fname(tmp_path / "a.nsy3")
+    proc = subprocess.run([execution.EXECUTOR, "runspec", "-"], input=runspec.to_bytes(), stderr=subprocess.PIPE)
+    assert proc.returncode == 1
+    assert f'File "{tmp_path / "a.nsy3"}", line 3\n    y = x + missing\n' in proc.stderr.decode()
+    assert "Line 3" not in proc.stderr.decode()
+
+    proc = subprocess.run([execution.EXECUTOR, "runspec", "-", "--disassemble"], input=runspec.to_bytes(),
+                          stderr=subprocess.PIPE)
+    assert "Line 1: x = 1\n" in proc.stderr.decode()
+    assert "Line 3: y = x + missing\n" in proc.stderr.decode()
+
+
+def test_module_builtins(tmp_path):
+    runspec = tmp_runspec(tmp_path, {"a": "x = 1\n", "b": "import a as a\nb = a.__builtins__\n"})
+    proc = subprocess.run([execution.EXECUTOR, "runspec", "-"], input=runspec.to_bytes(), stderr=subprocess.PIPE)
+    assert proc.returncode == 1
+    assert "__builtins__" in proc.stderr.decode()
+
+    # Builtins still resolve through a module's attributes
+    runspec = tmp_runspec(tmp_path, {"a": "x = 1\n", "b": "import a as a\n$b$ = a.len([1, 2])\n"})
+    assert runspec.execute(return_dvs=True) == {"b": 2}
+
+
+def test_trace(tmp_path):
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "test_dvars.nsy3")
+
+    def run(*args):
+        return subprocess.run([execution.EXECUTOR, "runspec", "-", *args], input=runspec.to_bytes(),
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+
+    quiet = run()
+    assert "Making get for" not in quiet.stderr.decode()
+    traced = run("--trace=dollar:2,notify:0")
+    assert traced.stdout == quiet.stdout
+    assert "Making set for " in traced.stderr.decode()
+    assert "Resolved in " in traced.stderr.decode()
+    assert "  notifying " not in traced.stderr.decode()
+    assert run("--trace=nothing:1").returncode == 1
+    for bad in ("--trace=dollar:-1", "--trace=dollar:300", "--trace=x"):
+        assert "Invalid trace levels" in run(bad).stderr.decode()
+
+    # Level 1 is recorded without --trace, for the dump that leads up to an error
+    failing = tmp_runspec(tmp_path, {"a": "x = missing\n"})
+    proc = subprocess.run([execution.EXECUTOR, "runspec", "-"], input=failing.to_bytes(), stderr=subprocess.PIPE)
+    assert f"Executing {tmp_path / 'a.nsy3'}\n" in proc.stderr.decode()
+
+
+def test_stream(tmp_path):
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "test_dvars.nsy3")
+    records = list(runspec.stream())
+    assert records[-1] == ["done"]
+    assert any(record[0] == "reset" for record in records)
+
+    subprocess.run([execution.EXECUTOR, "runspec", "-", f"--stream={tmp_path / 'stream'}"], input=runspec.to_bytes(),
+                   stdout=subprocess.DEVNULL, check=True)
+    with open(tmp_path / "stream", "rb") as f:
+        assert serialisation.read_stream(f) == runspec.execute(return_dvs=True)
+
+
+def test_store(tmp_path):
+    runspec = execution.Runspec([DIR]).add_fname(DIR / "test_dvars.nsy3")
+    dvs = runspec.execute(return_dvs=True)
+    runspec.execute(store=tmp_path / "results.nsy3s")
+    with serialisation.ResultStore(tmp_path / "results.nsy3s") as store:
+        assert len(store) == len(dvs)
+        assert store.keys() == sorted(dvs)
+        for name, value in dvs.items():
+            assert store[name] == value
+        assert "nonexistent" not in store
+
+    name = sorted(dvs)[len(dvs) // 2]
+    out = subprocess.run([execution.EXECUTOR, "lookup", tmp_path / "results.nsy3s", name],
+                         stdout=subprocess.PIPE, check=True).stdout
+    assert out.decode().startswith(f"{name} = ")
+    assert subprocess.run([execution.EXECUTOR, "lookup", tmp_path / "results.nsy3s", "nonexistent"]).returncode == 1
+
+    with pytest.raises(ValueError):
+        runspec.add_variant("v", {}).execute(store=tmp_path / "variants.nsy3s")
+
+
+def test_bundle(tmp_path):
+    (tmp_path / "a.nsy3").write_text("x = \"shared\"\n$a$ = [x, 2.5, 1]\n")
+    (tmp_path / "b.nsy3").write_text("import a as a\n$b$ = [a.x, \"shared\", 2.5, 1.0]\n")
+    runspec = execution.Runspec([tmp_path]).add_fname(tmp_path / "b.nsy3")
+    runspec.set_conclusion("$c$ = $b$\n")
+    pool_size = runspec.write_bundle(tmp_path / "all.nsy3b")
+    consts = sum(len(serialisation.deserialise(data, serialisation.deserialise(data)[1])[0]["consts"])
+                 for data in (f.read_bytes() for f in runspec.compiled_files))
+    assert pool_size < consts
+    assert runspec.execute(return_dvs=True, bundle=tmp_path / "all.nsy3b") == runspec.execute(return_dvs=True)
+
+    (tmp_path / "bad.nsy3b").write_bytes(b"NSY3BNDL")
+    assert subprocess.run([execution.EXECUTOR, "runbundle", tmp_path / "bad.nsy3b"]).returncode == 1
+
+
+def test_watch(tmp_path):
+    (tmp_path / "a.nsy3").write_text("x = 2\n$a$ = x\n")
+    (tmp_path / "b.nsy3").write_text("import a as a\n$b$ = $a$ + a.x\n")
+    (tmp_path / "c.nsy3").write_text("$c$ = 3\n")
+    runspec = execution.Runspec([tmp_path]).add_fname(tmp_path / "b.nsy3").add_fname(tmp_path / "c.nsy3")
+    watcher = runspec.watch(interval=20)
+    try:
+        assert watcher.results() == {"a": 2, "b": 4, "c": 3}
+
+        (tmp_path / "a.nsy3").write_text("x = 5\n$a$ = x\n")
+        runspec.compile_file(tmp_path / "a.nsy3")
+        assert watcher.diff() == {"changed": {"a": 5, "b": 10}, "removed": [], "sources": {"a": ["a"], "b": ["b"]}}
+
+        (tmp_path / "c.nsy3").write_text("$d$ = 4\n")
+        runspec.compile_file(tmp_path / "c.nsy3")
+        assert watcher.diff() == {"changed": {"d": 4}, "removed": ["c"], "sources": {"d": ["c"]}}
+
+        # Reloaded code is validated, and the watch carries on once it is fixed
+        corrupt(tmp_path / "c.nsy3c")
+        with pytest.raises(RuntimeError):
+            watcher.diff()
+        (tmp_path / "c.nsy3").write_text("$d$ = 7\n")
+        runspec.compile_file(tmp_path / "c.nsy3")
+        assert watcher.diff() == {"changed": {"d": 7}, "removed": [], "sources": {"d": ["c"]}}
+    finally:
+        watcher.close()
+
+    for interval in ("0", "-5", "soon"):
+        result = subprocess.run([execution.EXECUTOR, "watch", "-", f"--interval={interval}"], input=runspec.to_bytes(), capture_output=True)
+        assert result.returncode == 1
+        assert b"Invalid interval" in result.stderr
@@ -1,3 +1,5 @@
+import io
+
 from nsy3 import serialisation
 
 
@@ -26,3 +28,30 @@ def test_seqs():
 
     for obj, ser in cases:
         assert serialisation.deserialise(ser) == (obj, len(ser))
+
+
+def test_v2():
+    cases = [
+        0, -1, 2**40, -2**63, 2**63 - 1, 2.5, "hello", b"\x00\x01", True, False, None,
+        [1, "blue", "blue", {"blue": ["blue", 3]}],
+        {"x": {"x": "y"}, "y": [1.5, None]},
+        {1, 2, 3},
+    ]
+    for obj in cases:
+        ser = serialisation.serialise(obj, 2)
+        assert ser.startswith(serialisation.MAGIC)
+        assert serialisation.deserialise(ser) == (obj, len(ser))
+        assert serialisation.deserialise_from_file(io.BytesIO(ser)) == obj
+        assert serialisation.deserialise(b"xx" + ser, 2) == (obj, len(ser) + 2)
+
+
+def test_v2_compact():
+    assert serialisation.serialise(-2, 2) == serialisation.MAGIC + b"\x02\x00\x03"
+    assert serialisation.serialise(["ab", "ab"], 2) == serialisation.MAGIC + b"\x02\x05\x02\x02\x02ab\x0a\x00"
+    obj = [{"name": i, "value": i * 10} for i in range(100)]
+    assert len(serialisation.serialise(obj, 2)) < len(serialisation.serialise(obj)) / 2
+
+
+def test_v1_still_read_from_file():
+    obj = {"x": [1, 2.5, "y", b"z", None]}
+    assert serialisation.deserialise_from_file(io.BytesIO(serialisation.serialise(obj))) == obj